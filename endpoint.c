@@ -0,0 +1,159 @@
+/* -------------------------------------------------------------------------
+ *
+ * endpoint.c
+ *
+ * Primary endpoint publication for pg_keeper.
+ *
+ * As soon as this server becomes the master, pg_keeper announces
+ * pg_keeper.endpoint together with a generation number, so that local
+ * hooks can re-point connection poolers and clients without waiting for
+ * DNS or their own retries.  The announcement is written to
+ * pg_keeper.endpoint_file, replaced atomically by rename, and sent as a
+ * datagram to the Unix domain socket pg_keeper.endpoint_socket, if
+ * somebody listens there.  Both have the same content:
+ *
+ *		generation=<timeline>
+ *		endpoint=<pg_keeper.endpoint>
+ *
+ * The generation is our timeline, which grows with every promotion, so a
+ * listener can ignore announcements older than the last one it has seen,
+ * e.g. of a stale master coming back.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "pg_keeper.h"
+
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+
+void	publishEndpoint(void);
+
+static void writeEndpointFile(const char *announcement);
+static void sendEndpointSocket(const char *announcement);
+
+/* GUC variables */
+char	*pgkeeper_endpoint;
+char	*pgkeeper_endpoint_file;
+char	*pgkeeper_endpoint_socket;
+
+/*
+ * Announce this server as the master.
+ */
+void
+publishEndpoint(void)
+{
+	StringInfoData announcement;
+	TimeLineID	generation;
+
+	if (pgkeeper_endpoint == NULL || pgkeeper_endpoint[0] == '\0')
+		return;
+
+	if ((generation = keeperTimeLine()) == 0)
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper does not publish the endpoint while in recovery")));
+		return;
+	}
+
+	initStringInfo(&announcement);
+	appendStringInfo(&announcement, "generation=%u\nendpoint=%s\n",
+					 generation, pgkeeper_endpoint);
+
+	if (pgkeeper_endpoint_file != NULL && pgkeeper_endpoint_file[0] != '\0')
+		writeEndpointFile(announcement.data);
+
+	if (pgkeeper_endpoint_socket != NULL && pgkeeper_endpoint_socket[0] != '\0')
+		sendEndpointSocket(announcement.data);
+
+	ereport(LOG,
+			(errmsg("pg_keeper published endpoint \"%s\" with generation %u",
+					pgkeeper_endpoint, generation)));
+
+	pfree(announcement.data);
+}
+
+/*
+ * Write the announcement to a temporary file and rename it over the
+ * endpoint file, so that readers see either the old or the new one.
+ */
+static void
+writeEndpointFile(const char *announcement)
+{
+	char		tmppath[MAXPGPATH];
+	int			fd;
+	int			len = strlen(announcement);
+
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", pgkeeper_endpoint_file);
+
+	if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC,
+				   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+	{
+		ereport(LOG,
+				(errmsg("could not create endpoint file \"%s\": %m", tmppath)));
+		return;
+	}
+
+	if (write(fd, announcement, len) != len || pg_fsync(fd) != 0)
+	{
+		ereport(LOG,
+				(errmsg("could not write endpoint file \"%s\": %m", tmppath)));
+		close(fd);
+		unlink(tmppath);
+		return;
+	}
+	close(fd);
+
+	if (durable_rename(tmppath, pgkeeper_endpoint_file, LOG) != 0)
+		unlink(tmppath);
+}
+
+/*
+ * Push the announcement to the listener on the endpoint socket.  Nobody
+ * listening is not an error, the file is there for late listeners.
+ */
+static void
+sendEndpointSocket(const char *announcement)
+{
+	struct sockaddr_un addr;
+	int			sock;
+
+	if (strlen(pgkeeper_endpoint_socket) >= sizeof(addr.sun_path))
+	{
+		ereport(LOG,
+				(errmsg("endpoint socket path \"%s\" is too long",
+						pgkeeper_endpoint_socket)));
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, pgkeeper_endpoint_socket, sizeof(addr.sun_path));
+
+	if ((sock = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0)
+	{
+		ereport(LOG,
+				(errmsg("could not create endpoint socket: %m")));
+		return;
+	}
+
+	/* Don't let a stuck listener hold up the failover */
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+
+	if (sendto(sock, announcement, strlen(announcement), 0,
+			   (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		ereport((errno == ENOENT || errno == ECONNREFUSED) ? DEBUG1 : LOG,
+				(errmsg("could not send endpoint to socket \"%s\": %m",
+						pgkeeper_endpoint_socket)));
+
+	close(sock);
+}
@@ -0,0 +1,698 @@
+/* -------------------------------------------------------------------------
+ *
+ * follow.c
+ *
+ * Following a new master and replication slot synchronization for
+ * pg_keeper standby mode.
+ *
+ * With more than one standby, only the standby configured as failover
+ * candidate promotes itself when the master fails.  The others look for
+ * the new master among pg_keeper.peer_conninfos and re-point their
+ * replication to it.  To let them resume streaming without WAL having been
+ * recycled, every standby keeps a copy of the master's physical replication
+ * slots, advanced as the master's ones advance.  The copies we created are
+ * listed in SYNCED_SLOTS_FILE, so that we never touch other slots, e.g.
+ * those of cascading standbys.  A copy only starts reserving WAL from our
+ * current position, so until the master's slot has caught up with it, it
+ * doesn't cover a lagging consumer; we warn about such copies on promotion.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <ctype.h>
+
+#include "pg_keeper.h"
+
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "nodes/pg_list.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#if PG_VERSION_NUM >= 120000
+#include "utils/guc.h"
+#else
+#include "replication/walreceiver.h"
+#endif
+
+#define SQL_SET_PRIMARY_CONNINFO	"ALTER SYSTEM SET primary_conninfo TO %s"
+#define SQL_PRIMARY_SLOTS \
+	"SELECT slot_name, restart_lsn FROM pg_replication_slots " \
+	"WHERE slot_type = 'physical' AND restart_lsn IS NOT NULL"
+#define SQL_MY_SLOT				"SELECT slot_name FROM pg_stat_wal_receiver"
+#define SQL_CREATE_SLOT \
+	"SELECT pg_create_physical_replication_slot(slot_name, true) " \
+	"FROM (VALUES ('%s')) s(slot_name) " \
+	"WHERE slot_name NOT IN (SELECT slot_name FROM pg_replication_slots)"
+#define SQL_SLOT_AHEAD \
+	"SELECT restart_lsn > '%s' FROM pg_replication_slots WHERE slot_name = '%s'"
+#define SQL_ADVANCE_SLOT \
+	"SELECT pg_replication_slot_advance(slot_name, '%s') " \
+	"FROM pg_replication_slots WHERE slot_name = '%s' AND restart_lsn < '%s'"
+#define SQL_SLOT_ACTIVE \
+	"SELECT active FROM pg_replication_slots WHERE slot_name = '%s'"
+#define SQL_DROP_SLOT \
+	"SELECT pg_drop_replication_slot(slot_name) FROM pg_replication_slots " \
+	"WHERE slot_name = '%s' AND NOT active"
+
+/* Names of the slots we created, one per line */
+#define SYNCED_SLOTS_FILE	"pg_keeper.slots"
+
+/* Restart the server to make the new primary_conninfo effective */
+#define RESTART_SCRIPT	"\"$1/pg_ctl\" restart -D \"$2\" -m fast -w"
+
+char	*findNewMaster(void);
+char	*currentMaster(void);
+bool	isFollowing(const char *conninfo);
+void	followMaster(const char *conninfo);
+void	syncReplicationSlots(const char *conninfo);
+void	reportUnsyncedSlots(void);
+
+static char *currentPrimaryConninfo(void);
+static bool isSameServer(const char *conninfo1, const char *conninfo2);
+static char *conninfoValue(PQconninfoOption *options, const char *keyword);
+#if PG_VERSION_NUM >= 110000
+static void loadSyncedSlots(void);
+static void saveSyncedSlots(void);
+static bool isSyncedSlot(const char *name);
+static void setSlotAhead(const char *name, bool ahead);
+static bool dropSyncedSlot(PGconn *self, const char *name);
+#endif
+
+/* GUC variables */
+bool	pgkeeper_failover_candidate;
+char	*pgkeeper_peer_conninfos;
+bool	pgkeeper_sync_slots;
+
+#if PG_VERSION_NUM >= 110000
+/* Slots we created, as listed in SYNCED_SLOTS_FILE */
+static List *synced_slots = NIL;
+static bool synced_slots_loaded = false;
+
+/* Copies that reserve less WAL than the master's slot, as of the last sync */
+static List *ahead_slots = NIL;
+#endif
+
+/*
+ * Look for a master among the peers, preferring the one on the newest
+ * timeline. Returns its conninfo, or NULL if there is none (yet).
+ */
+char *
+findNewMaster(void)
+{
+	char	   *peers;
+	char	   *peer;
+	char	   *saveptr;
+	char	   *master = NULL;
+	TimeLineID	master_tli = 0;
+
+	if (pgkeeper_peer_conninfos == NULL || pgkeeper_peer_conninfos[0] == '\0')
+		return NULL;
+
+	peers = pstrdup(pgkeeper_peer_conninfos);
+
+	for (peer = strtok_r(peers, ";", &saveptr); peer != NULL;
+		 peer = strtok_r(NULL, ";", &saveptr))
+	{
+		TimeLineID	tli;
+
+		while (isspace((unsigned char) *peer))
+			peer++;
+		if (*peer == '\0')
+			continue;
+
+		/* A peer that hangs must not hold up the others */
+		tli = masterTimeLine(peer, keeperMonotonicUsec() +
+							 (uint64) pgkeeper_keepalives_time * 1000000);
+		if (tli > master_tli)
+		{
+			master = peer;
+			master_tli = tli;
+		}
+	}
+
+	if (master == NULL)
+		return NULL;
+
+	ereport(LOG,
+			(errmsg("pg_keeper found new master server on timeline %u : \"%s\"",
+					master_tli, master)));
+
+	return pstrdup(master);
+}
+
+/*
+ * Return which of the partner and the peers we are streaming from, going
+ * by the primary_conninfo in effect, or NULL if we can't tell.  Once we
+ * have followed a new master, this is how we find it again after a
+ * restart.
+ */
+char *
+currentMaster(void)
+{
+	char	   *peers;
+	char	   *peer;
+	char	   *saveptr;
+
+	if (isFollowing(pgkeeper_partner_conninfo))
+		return pstrdup(pgkeeper_partner_conninfo);
+
+	if (pgkeeper_peer_conninfos == NULL || pgkeeper_peer_conninfos[0] == '\0')
+		return NULL;
+
+	peers = pstrdup(pgkeeper_peer_conninfos);
+
+	for (peer = strtok_r(peers, ";", &saveptr); peer != NULL;
+		 peer = strtok_r(NULL, ";", &saveptr))
+	{
+		while (isspace((unsigned char) *peer))
+			peer++;
+		if (*peer == '\0')
+			continue;
+
+		if (isFollowing(peer))
+		{
+			char	   *result = pstrdup(peer);
+
+			pfree(peers);
+			return result;
+		}
+	}
+
+	pfree(peers);
+	return NULL;
+}
+
+/*
+ * Is the primary_conninfo in effect pointing at the server at conninfo?
+ */
+bool
+isFollowing(const char *conninfo)
+{
+	char	   *primary = currentPrimaryConninfo();
+
+	if (primary == NULL || primary[0] == '\0')
+		return false;
+
+	return isSameServer(primary, conninfo);
+}
+
+/*
+ * Return the primary_conninfo in effect.  Before PostgreSQL 12 it isn't a
+ * GUC, so take it from the walreceiver, which knows it only once started.
+ */
+static char *
+currentPrimaryConninfo(void)
+{
+#if PG_VERSION_NUM >= 120000
+	const char *primary = GetConfigOption("primary_conninfo", true, false);
+
+	return primary ? pstrdup(primary) : NULL;
+#else
+	char	   *primary = palloc(MAXCONNINFO);
+
+	SpinLockAcquire(&WalRcv->mutex);
+	strlcpy(primary, (char *) WalRcv->conninfo, MAXCONNINFO);
+	SpinLockRelease(&WalRcv->mutex);
+
+	return primary;
+#endif
+}
+
+/*
+ * Do the two connection strings point at the same server?  Only host,
+ * hostaddr and port are compared, since those are all that
+ * buildPrimaryConninfo() takes over.
+ */
+static bool
+isSameServer(const char *conninfo1, const char *conninfo2)
+{
+	static const char *const keywords[] = {"host", "hostaddr", "port"};
+	PQconninfoOption *options1;
+	PQconninfoOption *options2;
+	bool		same = true;
+	int			i;
+
+	options1 = PQconninfoParse(conninfo1, NULL);
+	options2 = PQconninfoParse(conninfo2, NULL);
+
+	if (options1 == NULL || options2 == NULL)
+		same = false;
+
+	for (i = 0; same && i < lengthof(keywords); i++)
+		same = strcmp(conninfoValue(options1, keywords[i]),
+					  conninfoValue(options2, keywords[i])) == 0;
+
+	if (options1)
+		PQconninfoFree(options1);
+	if (options2)
+		PQconninfoFree(options2);
+
+	return same;
+}
+
+/*
+ * Return the value of keyword in options, "" if unset, except for the
+ * port which defaults like libpq does.
+ */
+static char *
+conninfoValue(PQconninfoOption *options, const char *keyword)
+{
+	PQconninfoOption *option;
+
+	for (option = options; option->keyword != NULL; option++)
+	{
+		if (strcmp(option->keyword, keyword) == 0 &&
+			option->val != NULL && option->val[0] != '\0')
+			return option->val;
+	}
+
+	return strcmp(keyword, "port") == 0 ? DEF_PGPORT_STR : "";
+}
+
+/*
+ * Re-point our replication to the master at conninfo.
+ *
+ * Since PostgreSQL 13 a reload is enough for the startup process to
+ * reconnect with the new primary_conninfo. Older releases need a restart,
+ * which we leave to a background script since it terminates us too.
+ */
+void
+followMaster(const char *conninfo)
+{
+	ereport(LOG,
+			(errmsg("pg_keeper re-points replication to new master server : \"%s\"",
+					conninfo)));
+
+#if PG_VERSION_NUM >= 120000
+	{
+		char	   *primary_conninfo = buildPrimaryConninfo(conninfo);
+		StringInfoData sql;
+
+		initStringInfo(&sql);
+		appendStringInfo(&sql, SQL_SET_PRIMARY_CONNINFO,
+						 quote_literal_cstr(primary_conninfo));
+
+		if (!execSQL(pgkeeper_my_conninfo, sql.data))
+			ereport(ERROR,
+					(errmsg("failed to execute ALTER SYSTEM to change primary_conninfo")));
+	}
+
+#if PG_VERSION_NUM >= 130000
+	if (kill(PostmasterPid, SIGHUP) != 0)
+		ereport(ERROR,
+				(errmsg("failed to send SIGHUP signal to postmaster process : %d",
+						PostmasterPid)));
+#else
+	launchKeeperScript(RESTART_SCRIPT, NULL, NULL);
+#endif
+
+#else
+	{
+		char	   *conf = buildRecoveryConf(conninfo);
+		char		path[MAXPGPATH];
+		FILE	   *fp;
+
+		snprintf(path, MAXPGPATH, "%s/recovery.conf", DataDir);
+		if ((fp = fopen(path, "w")) == NULL)
+			ereport(ERROR,
+					(errmsg("could not create recovery file: \"%s\"", path)));
+		fprintf(fp, "%s\n", conf);
+		if (fclose(fp))
+			ereport(ERROR,
+					(errmsg("could not close recovery file: \"%s\"", path)));
+	}
+
+	launchKeeperScript(RESTART_SCRIPT, NULL, NULL);
+#endif
+}
+
+/*
+ * Copy the physical replication slots of the master at conninfo to this
+ * standby, and advance our copies as far as the master's ones.  Copies
+ * of slots the master no longer has are dropped once inactive.  Slots we
+ * didn't create are left alone, even if the master has one of the same
+ * name.  The slot we stream through is of no use on this server, so it
+ * is skipped.
+ *
+ * A copy starts reserving WAL from our current position, which may be
+ * ahead of the master's slot, e.g. of a lagging consumer.  Such a copy
+ * doesn't hold back the WAL that consumer needs, so it is left alone
+ * until the master's slot has caught up with it, and reported by
+ * reportUnsyncedSlots().  From then on, since a standby can only advance
+ * a slot up to its replay position, the copy never holds back less WAL
+ * than the master's slot would.
+ */
+void
+syncReplicationSlots(const char *conninfo)
+{
+#if PG_VERSION_NUM >= 110000
+	PGconn	   *master;
+	PGconn	   *self;
+	PGresult   *slots;
+	PGresult   *res;
+	const char *my_slot = NULL;
+	List	   *master_slots = NIL;
+	ListCell   *cell;
+	bool		changed = false;
+	StringInfoData sql;
+	int			i;
+
+	if (!pgkeeper_sync_slots)
+		return;
+
+	if (!synced_slots_loaded)
+		loadSyncedSlots();
+
+	master = PQconnectdb(conninfo);
+	self = PQconnectdb(pgkeeper_my_conninfo);
+	if (PQstatus(master) != CONNECTION_OK || PQstatus(self) != CONNECTION_OK)
+	{
+		PQfinish(master);
+		PQfinish(self);
+		return;
+	}
+
+	slots = PQexec(master, SQL_PRIMARY_SLOTS);
+	if (PQresultStatus(slots) != PGRES_TUPLES_OK)
+	{
+		ereport(LOG,
+				(errmsg("could not get replication slots from server : \"%s\"",
+						conninfo)));
+		PQclear(slots);
+		PQfinish(master);
+		PQfinish(self);
+		return;
+	}
+
+	res = PQexec(self, SQL_MY_SLOT);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0 &&
+		!PQgetisnull(res, 0, 0))
+		my_slot = pstrdup(PQgetvalue(res, 0, 0));
+	PQclear(res);
+
+	initStringInfo(&sql);
+
+	/* Slot names consist of [a-z0-9_] only, so they need no quoting */
+	for (i = 0; i < PQntuples(slots); i++)
+	{
+		const char *name = PQgetvalue(slots, i, 0);
+		const char *lsn = PQgetvalue(slots, i, 1);
+
+		if (my_slot && strcmp(name, my_slot) == 0)
+			continue;
+
+		master_slots = lappend(master_slots, pstrdup(name));
+
+		/* Creates the slot unless there is one of that name already */
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, SQL_CREATE_SLOT, name);
+		res = PQexec(self, sql.data);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			ereport(LOG,
+					(errmsg("could not create replication slot \"%s\": %s",
+							name, PQerrorMessage(self))));
+		else if (PQntuples(res) > 0 && !isSyncedSlot(name))
+		{
+			MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+			synced_slots = lappend(synced_slots, pstrdup(name));
+			MemoryContextSwitchTo(oldcontext);
+			changed = true;
+		}
+		PQclear(res);
+
+		if (!isSyncedSlot(name))
+			continue;
+
+		/* Not of use until the master's slot has caught up with ours */
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, SQL_SLOT_AHEAD, lsn, name);
+		res = PQexec(self, sql.data);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0 ||
+			strcmp(PQgetvalue(res, 0, 0), "t") == 0)
+		{
+			setSlotAhead(name, true);
+			PQclear(res);
+			continue;
+		}
+		PQclear(res);
+		setSlotAhead(name, false);
+
+		resetStringInfo(&sql);
+		appendStringInfo(&sql, SQL_ADVANCE_SLOT, lsn, name, lsn);
+		res = PQexec(self, sql.data);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK)
+			ereport(LOG,
+					(errmsg("could not advance replication slot \"%s\": %s",
+							name, PQerrorMessage(self))));
+		PQclear(res);
+	}
+
+	/* Drop our copies of the slots the master no longer has */
+#if PG_VERSION_NUM >= 130000
+	foreach(cell, synced_slots)
+	{
+		char	   *name = (char *) lfirst(cell);
+		ListCell   *master_cell;
+		bool		found = false;
+
+		foreach(master_cell, master_slots)
+			found = found || strcmp(name, (char *) lfirst(master_cell)) == 0;
+
+		if (!found && dropSyncedSlot(self, name))
+		{
+			setSlotAhead(name, false);
+			synced_slots = foreach_delete_current(synced_slots, cell);
+			pfree(name);
+			changed = true;
+		}
+	}
+#else
+	{
+		ListCell   *prev = NULL;
+		ListCell   *next;
+
+		for (cell = list_head(synced_slots); cell != NULL; cell = next)
+		{
+			char	   *name = (char *) lfirst(cell);
+			ListCell   *master_cell;
+			bool		found = false;
+
+			next = lnext(cell);
+
+			foreach(master_cell, master_slots)
+				found = found || strcmp(name, (char *) lfirst(master_cell)) == 0;
+
+			if (!found && dropSyncedSlot(self, name))
+			{
+				setSlotAhead(name, false);
+				synced_slots = list_delete_cell(synced_slots, cell, prev);
+				pfree(name);
+				changed = true;
+			}
+			else
+				prev = cell;
+		}
+	}
+#endif
+
+	if (changed)
+		saveSyncedSlots();
+
+	PQclear(slots);
+	PQfinish(master);
+	PQfinish(self);
+#endif
+}
+
+/*
+ * Warn about the copies that didn't reserve all the WAL the master's slot
+ * did as of the last sync, called before promoting.  A consumer of such a
+ * slot may need WAL we never had, and then has to be cloned again.
+ */
+void
+reportUnsyncedSlots(void)
+{
+#if PG_VERSION_NUM >= 110000
+	ListCell   *cell;
+
+	foreach(cell, ahead_slots)
+		ereport(WARNING,
+				(errmsg("replication slot \"%s\" has not caught up with the master's one",
+						(char *) lfirst(cell)),
+				 errdetail("A standby streaming through it may need WAL that this server does not have.")));
+#endif
+}
+
+#if PG_VERSION_NUM >= 110000
+/*
+ * Remember whether our copy of the slot name is ahead of the master's.
+ */
+static void
+setSlotAhead(const char *name, bool ahead)
+{
+	ListCell   *cell;
+	MemoryContext oldcontext;
+
+	foreach(cell, ahead_slots)
+	{
+		if (strcmp((char *) lfirst(cell), name) == 0)
+		{
+			if (!ahead)
+			{
+				char	   *old = (char *) lfirst(cell);
+
+				ahead_slots = list_delete_ptr(ahead_slots, old);
+				pfree(old);
+			}
+			return;
+		}
+	}
+
+	if (!ahead)
+		return;
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	ahead_slots = lappend(ahead_slots, pstrdup(name));
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Drop our copy of the slot name unless it is in use, e.g. by a cascading
+ * standby.  Returns true if it is gone, so that we can forget about it.
+ */
+static bool
+dropSyncedSlot(PGconn *self, const char *name)
+{
+	StringInfoData sql;
+	PGresult   *res;
+	bool		gone;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql, SQL_SLOT_ACTIVE, name);
+	res = PQexec(self, sql.data);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		PQclear(res);
+		return false;
+	}
+
+	/* Dropped by somebody else already */
+	if (PQntuples(res) == 0)
+	{
+		PQclear(res);
+		return true;
+	}
+
+	if (strcmp(PQgetvalue(res, 0, 0), "t") == 0)
+	{
+		PQclear(res);
+		return false;
+	}
+	PQclear(res);
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql, SQL_DROP_SLOT, name);
+	res = PQexec(self, sql.data);
+	gone = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0;
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		ereport(LOG,
+				(errmsg("could not drop replication slot \"%s\": %s",
+						name, PQerrorMessage(self))));
+	PQclear(res);
+
+	return gone;
+}
+
+/*
+ * Is name one of the slots we created?
+ */
+static bool
+isSyncedSlot(const char *name)
+{
+	ListCell   *cell;
+
+	foreach(cell, synced_slots)
+	{
+		if (strcmp((char *) lfirst(cell), name) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Read the list of slots we created from SYNCED_SLOTS_FILE, if any.
+ */
+static void
+loadSyncedSlots(void)
+{
+	MemoryContext oldcontext;
+	char		path[MAXPGPATH];
+	char		line[NAMEDATALEN + 2];
+	FILE	   *fp;
+
+	synced_slots_loaded = true;
+
+	snprintf(path, MAXPGPATH, "%s/%s", DataDir, SYNCED_SLOTS_FILE);
+	if ((fp = AllocateFile(path, "r")) == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", path)));
+		return;
+	}
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] != '\0' && !isSyncedSlot(line))
+			synced_slots = lappend(synced_slots, pstrdup(line));
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	FreeFile(fp);
+}
+
+/*
+ * Write the list of slots we created to SYNCED_SLOTS_FILE.  The file is
+ * replaced atomically, so a crash leaves either the old or the new list.
+ */
+static void
+saveSyncedSlots(void)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	ListCell   *cell;
+	FILE	   *fp;
+
+	snprintf(path, MAXPGPATH, "%s/%s", DataDir, SYNCED_SLOTS_FILE);
+	snprintf(tmppath, MAXPGPATH, "%s.tmp", path);
+
+	if ((fp = AllocateFile(tmppath, "w")) == NULL)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not create file \"%s\": %m", tmppath)));
+		return;
+	}
+
+	foreach(cell, synced_slots)
+		fprintf(fp, "%s\n", (char *) lfirst(cell));
+
+	if (FreeFile(fp) != 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+		return;
+	}
+
+	(void) durable_rename(tmppath, path, LOG);
+}
+#endif
@@ -0,0 +1,1382 @@
+/* -------------------------------------------------------------------------
+ *
+ * gossip.c
+ *
+ * SWIM-style gossip membership for pg_keeper.
+ *
+ * Every protocol period each node probes one member, chosen round-robin
+ * in random order, with a PING over UDP.  If no ACK arrives in time, it
+ * asks pgkeeper_gossip_indirect_checks other members to probe the target
+ * on its behalf (PING_REQ); only if none of them gets an ACK either, the
+ * target becomes suspect, and dead if it doesn't refute the suspicion for
+ * a few periods.  Membership changes, together with roles and WAL
+ * positions, are piggybacked on the protocol messages, so the probe and
+ * dissemination cost per node stays constant as the cluster grows.
+ *
+ * A member refutes a suspicion by bumping its incarnation number.  An
+ * update about a member only overrides what we know if it is newer by
+ * incarnation, or carries a stronger state at the same incarnation.
+ * Dead members are forgotten after a while, except for the seeds.
+ *
+ * Every message carries an HMAC-SHA-256 over its contents keyed with a
+ * secret shared by all members, and a number that grows with every
+ * message its sender sends during one incarnation, so that messages from
+ * outside the cluster and replayed messages of a member are ignored.  To
+ * keep a restarted member's messages from being taken for replays, its
+ * incarnation must grow across restarts, so it is recorded in a state
+ * file.
+ *
+ * This file is built into both the pg_keeper worker and the standalone
+ * witness, so it relies on c.h and libpgcommon only.  The HMAC requires
+ * PostgreSQL 11 or later.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#ifdef FRONTEND
+#include "postgres_fe.h"
+#else
+#include "postgres.h"
+#endif
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if PG_VERSION_NUM >= 140000
+#include "common/hmac.h"
+#elif PG_VERSION_NUM >= 110000
+#include "common/sha2.h"
+#endif
+#ifndef FRONTEND
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+#endif
+
+#include "gossip.h"
+
+#ifdef FRONTEND
+#define gossip_log(...) \
+	do { fprintf(stderr, __VA_ARGS__); fputc('\n', stderr); } while (0)
+#else
+#define gossip_log(...)	elog(LOG, __VA_ARGS__)
+#endif
+
+#define GOSSIP_MAGIC			0x504b4750	/* "PKGP" */
+#define GOSSIP_PROTOCOL_VERSION	3
+
+#define GOSSIP_MSG_PING			1
+#define GOSSIP_MSG_ACK			2
+#define GOSSIP_MSG_PING_REQ		3
+
+#define GOSSIP_MAX_UPDATES		8	/* piggybacked updates per message */
+#define GOSSIP_MAX_RELAYS		16	/* outstanding PING_REQs we serve */
+#define GOSSIP_EXPIRE_FACTOR	10	/* dead members are kept this many
+									 * times as long as suspects */
+
+/* magic, version, type, nupdates, seq, msgno, sender, target */
+#define GOSSIP_HEADER_SIZE \
+	(4 + 1 + 1 + 1 + 4 + 8 + GOSSIP_UPDATE_SIZE + GOSSIP_NAME_LEN)
+/* name, state, role, incarnation, lsn */
+#define GOSSIP_UPDATE_SIZE		(GOSSIP_NAME_LEN + 1 + 1 + 4 + 8)
+/* HMAC-SHA-256 of everything before it */
+#define GOSSIP_MAC_SIZE			32	/* PG_SHA256_DIGEST_LENGTH */
+#define GOSSIP_MAX_MSG_SIZE \
+	(GOSSIP_HEADER_SIZE + GOSSIP_MAX_UPDATES * GOSSIP_UPDATE_SIZE + \
+	 GOSSIP_MAC_SIZE)
+
+/* The probe of the current protocol period */
+typedef enum GossipProbePhase
+{
+	PROBE_NONE = 0,				/* no probe, or it was acked */
+	PROBE_DIRECT,				/* waiting for ACK of our PING */
+	PROBE_INDIRECT				/* waiting for ACK through other members */
+} GossipProbePhase;
+
+/* Our bookkeeping of a member */
+typedef struct GossipEntry
+{
+	GossipMember member;
+	struct sockaddr_storage addr;
+	socklen_t	addrlen;		/* 0 if the name could not be resolved */
+	int			transmits;		/* times left to piggyback this member */
+	bool		seed;			/* never forgotten */
+	uint32		last_incarnation;	/* of the last message it sent us */
+	uint64		last_msgno;		/* likewise */
+} GossipEntry;
+
+/* A PING_REQ we are serving: forward the ACK of seq to origin */
+typedef struct GossipRelay
+{
+	bool		used;
+	uint32		seq;			/* seq of our PING to the target */
+	int			target;
+	int			origin;
+	uint32		origin_seq;
+	uint64		expires;
+} GossipRelay;
+
+/* Settings */
+int			pgkeeper_gossip_interval = 1000;
+int			pgkeeper_gossip_indirect_checks = 3;
+
+static int	gossip_sock = -1;
+static int	gossip_family;
+
+/* members[0] is ourselves */
+static GossipEntry members[GOSSIP_MAX_MEMBERS];
+static int	nmembers = 0;
+
+static uint32 next_seq = 1;
+static uint64 next_msgno = 1;	/* restarts with every incarnation */
+static GossipRelay relays[GOSSIP_MAX_RELAYS];
+
+/* Where our incarnation is recorded, empty if nowhere */
+static char state_path[MAXPGPATH];
+
+/* The shared secret */
+#if PG_VERSION_NUM >= 140000
+static pg_hmac_ctx *hmac_ctx = NULL;
+static char *hmac_key = NULL;
+#elif PG_VERSION_NUM >= 110000
+static uint8 key_ipad[PG_SHA256_BLOCK_LENGTH];
+static uint8 key_opad[PG_SHA256_BLOCK_LENGTH];
+#endif
+
+/* State of the current protocol period */
+static GossipProbePhase probe_phase = PROBE_NONE;
+static int	probe_target;
+static uint32 probe_seq;
+static uint64 probe_deadline;	/* when to fall back to indirect probing */
+static uint64 next_period;		/* when the next period starts */
+
+/* Roles any other member has had since we started */
+static bool roles_seen[GOSSIP_ROLE_WITNESS + 1];
+
+/* Members in random order; we probe them round-robin */
+static int	probe_order[GOSSIP_MAX_MEMBERS];
+static int	probe_norder = 0;
+static int	probe_pos = 0;
+
+static uint64 gossipNow(void);
+static int	addMember(const char *name, GossipState state, uint32 incarnation,
+					  bool seed);
+static void removeMember(int idx);
+static int	findMember(const char *name);
+static bool resolveMember(GossipEntry *entry);
+static bool splitName(const char *name, char *host, char *port);
+static void setState(int idx, GossipState state, uint32 incarnation);
+static int	transmitLimit(void);
+static void noteRole(GossipRole role);
+static void applyDirectContact(int idx, GossipRole role, uint32 incarnation,
+							   uint64 lsn);
+static void applyUpdate(const char *name, GossipState state, GossipRole role,
+						uint32 incarnation, uint64 lsn);
+static void sendMessage(int to, int type, uint32 seq, int target);
+static void handleMessage(const char *buf, int len);
+static void startProbe(uint64 now);
+static int	nextProbeTarget(void);
+static void probeAcked(void);
+static int	compareTransmits(const void *a, const void *b);
+
+/* Message authentication */
+static bool setSecret(const char *secret);
+static bool computeMac(const char *buf, int len, uint8 *mac);
+static uint32 startIncarnation(void);
+static void saveIncarnation(uint32 incarnation);
+
+/* Serialization helpers, integers go in network byte order */
+static char *putU8(char *p, uint8 v);
+static char *putU32(char *p, uint32 v);
+static char *putU64(char *p, uint64 v);
+static char *putName(char *p, const char *name);
+static const char *getU8(const char *p, uint8 *v);
+static const char *getU32(const char *p, uint32 *v);
+static const char *getU64(const char *p, uint64 *v);
+static const char *getName(const char *p, char *name);
+
+/*
+ * Open the gossip socket bound to self ("host:port") and register the
+ * comma-separated seed members.  All members must use the same secret.
+ * Our incarnation is recorded in state_file, if not NULL.  Returns false
+ * on failure.
+ */
+bool
+gossipInit(const char *self, const char *seeds, const char *secret,
+		   const char *state_file)
+{
+	char		host[GOSSIP_NAME_LEN];
+	char		port[GOSSIP_NAME_LEN];
+	struct addrinfo hints;
+	struct addrinfo *res;
+	int			ret;
+
+	if (gossip_sock >= 0)
+		return true;
+
+	if (secret == NULL || secret[0] == '\0')
+	{
+		gossip_log("gossip: a shared secret is required");
+		return false;
+	}
+	if (!setSecret(secret))
+		return false;
+
+	strlcpy(state_path, state_file ? state_file : "", sizeof(state_path));
+
+	if (!splitName(self, host, port))
+	{
+		gossip_log("gossip: invalid address \"%s\"", self);
+		return false;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((ret = getaddrinfo(host, port, &hints, &res)) != 0)
+	{
+		gossip_log("gossip: could not resolve \"%s\": %s", self,
+				   gai_strerror(ret));
+		return false;
+	}
+
+	gossip_family = res->ai_family;
+	gossip_sock = socket(res->ai_family, SOCK_DGRAM, 0);
+	if (gossip_sock < 0 ||
+		fcntl(gossip_sock, F_SETFL, O_NONBLOCK) < 0 ||
+		fcntl(gossip_sock, F_SETFD, FD_CLOEXEC) < 0 ||
+		bind(gossip_sock, res->ai_addr, res->ai_addrlen) < 0)
+	{
+		gossip_log("gossip: could not bind to \"%s\": %s", self,
+				   strerror(errno));
+		if (gossip_sock >= 0)
+			close(gossip_sock);
+		gossip_sock = -1;
+		freeaddrinfo(res);
+		return false;
+	}
+	freeaddrinfo(res);
+
+	/*
+	 * Start with a new incarnation, so that we override whatever the
+	 * others remember about a previous run of ourselves, and our messages
+	 * are not taken for replays of those of the previous run.
+	 */
+	nmembers = 0;
+	addMember(self, GOSSIP_ALIVE, startIncarnation(), false);
+	next_msgno = 1;
+
+	if (seeds != NULL)
+	{
+		char		buf[GOSSIP_NAME_LEN];
+		const char *p = seeds;
+
+		while (*p)
+		{
+			int			len = 0;
+
+			while (*p == ',' || *p == ' ')
+				p++;
+			while (p[len] && p[len] != ',' && p[len] != ' ')
+				len++;
+			if (len == 0)
+				break;
+
+			if (len < GOSSIP_NAME_LEN)
+			{
+				memcpy(buf, p, len);
+				buf[len] = '\0';
+				if (findMember(buf) < 0)
+					addMember(buf, GOSSIP_ALIVE, 0, true);
+			}
+			p += len;
+		}
+	}
+
+	srandom((unsigned int) (gossipNow() ^ getpid()));
+	next_period = gossipNow();
+
+	return true;
+}
+
+/* Return the gossip socket, or -1 if gossip is not running */
+int
+gossipSocket(void)
+{
+	return gossip_sock;
+}
+
+/*
+ * Process all the messages waiting on the socket.
+ */
+void
+gossipReceive(void)
+{
+	char		buf[GOSSIP_MAX_MSG_SIZE];
+	ssize_t		len;
+
+	if (gossip_sock < 0)
+		return;
+
+	while ((len = recv(gossip_sock, buf, sizeof(buf), 0)) > 0)
+		handleMessage(buf, (int) len);
+}
+
+/*
+ * Do whatever the protocol requires at this point in time. Call this at
+ * least every gossipTimeout() milliseconds.
+ */
+void
+gossipRun(void)
+{
+	uint64		now = gossipNow();
+	uint64		interval = (uint64) pgkeeper_gossip_interval * 1000;
+	int			i;
+
+	if (gossip_sock < 0)
+		return;
+
+	/* Forget relays whose target never answered */
+	for (i = 0; i < GOSSIP_MAX_RELAYS; i++)
+		if (relays[i].used && now >= relays[i].expires)
+			relays[i].used = false;
+
+	/* No direct ACK in time, ask others to probe the target for us */
+	if (probe_phase == PROBE_DIRECT && now >= probe_deadline)
+	{
+		int			candidates[GOSSIP_MAX_MEMBERS];
+		int			ncandidates = 0;
+		int			n;
+
+		for (i = 1; i < nmembers; i++)
+			if (i != probe_target && members[i].member.state == GOSSIP_ALIVE)
+				candidates[ncandidates++] = i;
+
+		for (n = 0; n < pgkeeper_gossip_indirect_checks && ncandidates > 0; n++)
+		{
+			int			pick = random() % ncandidates;
+
+			sendMessage(candidates[pick], GOSSIP_MSG_PING_REQ, probe_seq,
+						probe_target);
+			candidates[pick] = candidates[--ncandidates];
+		}
+
+		probe_phase = PROBE_INDIRECT;
+	}
+
+	if (now < next_period)
+		return;
+
+	/* Nobody could reach the target during the last period */
+	if (probe_phase != PROBE_NONE &&
+		members[probe_target].member.state == GOSSIP_ALIVE)
+		setState(probe_target, GOSSIP_SUSPECT,
+				 members[probe_target].member.incarnation);
+
+	/* Suspects that didn't refute in time are considered dead */
+	for (i = 1; i < nmembers; i++)
+	{
+		GossipMember *m = &members[i].member;
+
+		/* state_since may be later than now if it was suspected just now */
+		if (m->state == GOSSIP_SUSPECT &&
+			now >= m->state_since + interval * transmitLimit())
+			setState(i, GOSSIP_DEAD, m->incarnation);
+	}
+
+	/*
+	 * Forget members that have been dead for long, once the news has
+	 * spread. Going backwards, since removing moves the last one here.
+	 */
+	for (i = nmembers - 1; i > 0; i--)
+	{
+		GossipMember *m = &members[i].member;
+
+		if (m->state == GOSSIP_DEAD && !members[i].seed &&
+			now >= m->state_since +
+			interval * transmitLimit() * GOSSIP_EXPIRE_FACTOR)
+		{
+			gossip_log("gossip: forgetting dead member \"%s\"", m->name);
+			removeMember(i);
+		}
+	}
+
+	startProbe(now);
+	next_period = now + interval;
+}
+
+/*
+ * Return the time in milliseconds until gossipRun() needs to be called.
+ */
+long
+gossipTimeout(void)
+{
+	uint64		now = gossipNow();
+	uint64		next = next_period;
+
+	if (probe_phase == PROBE_DIRECT && probe_deadline < next)
+		next = probe_deadline;
+
+	if (next <= now)
+		return 0;
+
+	return (long) ((next - now) / 1000) + 1;
+}
+
+/*
+ * Update our own role and WAL position. A role change is disseminated
+ * actively, the WAL position only travels with our messages.
+ */
+void
+gossipSetSelf(GossipRole role, uint64 lsn)
+{
+	GossipMember *self;
+
+	if (nmembers == 0)
+		return;
+
+	self = &members[0].member;
+	self->lsn = lsn;
+
+	if (self->role != role)
+	{
+		self->role = role;
+		members[0].transmits = transmitLimit();
+	}
+}
+
+/*
+ * Copy up to max members into the given array, ourselves first.
+ */
+int
+gossipGetMembers(GossipMember *out, int max)
+{
+	int			i;
+
+	for (i = 0; i < nmembers && i < max; i++)
+		out[i] = members[i].member;
+
+	return i;
+}
+
+/*
+ * Is there any other member in the given role that we consider alive?
+ */
+bool
+gossipRoleIsAlive(GossipRole role)
+{
+	int			i;
+
+	for (i = 1; i < nmembers; i++)
+		if (members[i].member.role == role &&
+			members[i].member.state == GOSSIP_ALIVE)
+			return true;
+
+	return false;
+}
+
+/*
+ * Has any other member had the given role since we started, whether or
+ * not we still know of it?
+ */
+bool
+gossipRoleWasSeen(GossipRole role)
+{
+	return (unsigned int) role <= GOSSIP_ROLE_WITNESS && roles_seen[role];
+}
+
+const char *
+gossipStateName(GossipState state)
+{
+	switch (state)
+	{
+		case GOSSIP_ALIVE:
+			return "alive";
+		case GOSSIP_SUSPECT:
+			return "suspect";
+		case GOSSIP_DEAD:
+			return "dead";
+	}
+	return "unknown";
+}
+
+const char *
+gossipRoleName(GossipRole role)
+{
+	switch (role)
+	{
+		case GOSSIP_ROLE_MASTER:
+			return "master";
+		case GOSSIP_ROLE_STANDBY:
+			return "standby";
+		case GOSSIP_ROLE_WITNESS:
+			return "witness";
+		case GOSSIP_ROLE_UNKNOWN:
+			break;
+	}
+	return "unknown";
+}
+
+/* Microseconds on the monotonic clock */
+static uint64
+gossipNow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Register a new member.  If we are full, make room by forgetting the
+ * member that has been dead for longest.  Returns its index, or -1 if
+ * there is no room.
+ */
+static int
+addMember(const char *name, GossipState state, uint32 incarnation, bool seed)
+{
+	GossipEntry *entry;
+
+	if (nmembers >= GOSSIP_MAX_MEMBERS)
+	{
+		int			oldest = -1;
+		int			i;
+
+		for (i = 1; i < nmembers; i++)
+		{
+			GossipMember *m = &members[i].member;
+
+			if (m->state == GOSSIP_DEAD && !members[i].seed &&
+				(oldest < 0 ||
+				 m->state_since < members[oldest].member.state_since))
+				oldest = i;
+		}
+
+		if (oldest < 0)
+		{
+			gossip_log("gossip: too many members, ignoring \"%s\"", name);
+			return -1;
+		}
+
+		gossip_log("gossip: forgetting dead member \"%s\" to make room",
+				   members[oldest].member.name);
+		removeMember(oldest);
+	}
+
+	entry = &members[nmembers];
+	memset(entry, 0, sizeof(GossipEntry));
+	strlcpy(entry->member.name, name, GOSSIP_NAME_LEN);
+	entry->member.state = state;
+	entry->member.role = GOSSIP_ROLE_UNKNOWN;
+	entry->member.incarnation = incarnation;
+	entry->member.state_since = gossipNow();
+	entry->seed = seed;
+
+	if (nmembers > 0)
+	{
+		if (!seed)
+			gossip_log("gossip: member \"%s\" joined", name);
+
+		resolveMember(entry);
+		entry->transmits = transmitLimit();
+
+		/* Probe it at a random point of the current round */
+		if (probe_norder < GOSSIP_MAX_MEMBERS)
+		{
+			int			pos = probe_pos + random() % (probe_norder - probe_pos + 1);
+
+			probe_order[probe_norder++] = probe_order[pos];
+			probe_order[pos] = nmembers;
+		}
+	}
+
+	return nmembers++;
+}
+
+/*
+ * Forget the member at idx, moving the last member to its place.
+ */
+static void
+removeMember(int idx)
+{
+	int			last = nmembers - 1;
+	int			i;
+
+	if (probe_phase != PROBE_NONE && probe_target == idx)
+		probe_phase = PROBE_NONE;
+	else if (probe_target == last)
+		probe_target = idx;
+
+	for (i = 0; i < GOSSIP_MAX_RELAYS; i++)
+	{
+		if (!relays[i].used)
+			continue;
+
+		if (relays[i].target == idx || relays[i].origin == idx)
+			relays[i].used = false;
+		if (relays[i].target == last)
+			relays[i].target = idx;
+		if (relays[i].origin == last)
+			relays[i].origin = idx;
+	}
+
+	if (idx != last)
+		members[idx] = members[last];
+	nmembers--;
+
+	/* The probe order refers to indexes, so start a new round */
+	probe_pos = probe_norder;
+}
+
+static int
+findMember(const char *name)
+{
+	int			i;
+
+	for (i = 0; i < nmembers; i++)
+		if (strcmp(members[i].member.name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+static bool
+resolveMember(GossipEntry *entry)
+{
+	char		host[GOSSIP_NAME_LEN];
+	char		port[GOSSIP_NAME_LEN];
+	struct addrinfo hints;
+	struct addrinfo *res;
+
+	entry->addrlen = 0;
+
+	if (!splitName(entry->member.name, host, port))
+		return false;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = gossip_family;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+	{
+		gossip_log("gossip: could not resolve member \"%s\"",
+				   entry->member.name);
+		return false;
+	}
+
+	memcpy(&entry->addr, res->ai_addr, res->ai_addrlen);
+	entry->addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return true;
+}
+
+/*
+ * Split "host:port" or "[host]:port" into its parts.
+ */
+static bool
+splitName(const char *name, char *host, char *port)
+{
+	const char *colon = strrchr(name, ':');
+	size_t		hostlen;
+
+	if (colon == NULL || colon == name || colon[1] == '\0')
+		return false;
+
+	hostlen = colon - name;
+	if (name[0] == '[' && colon[-1] == ']')
+	{
+		name++;
+		hostlen -= 2;
+	}
+	if (hostlen >= GOSSIP_NAME_LEN)
+		return false;
+
+	memcpy(host, name, hostlen);
+	host[hostlen] = '\0';
+	strlcpy(port, colon + 1, GOSSIP_NAME_LEN);
+
+	return true;
+}
+
+static void
+setState(int idx, GossipState state, uint32 incarnation)
+{
+	GossipMember *m = &members[idx].member;
+
+	if (m->state != state)
+	{
+		gossip_log("gossip: member \"%s\" is now %s", m->name,
+				   gossipStateName(state));
+		m->state_since = gossipNow();
+	}
+
+	m->state = state;
+	m->incarnation = incarnation;
+	members[idx].transmits = transmitLimit();
+}
+
+/*
+ * How many times an update is piggybacked, and how many periods a
+ * suspect has to refute: both scale with log2 of the cluster size.
+ */
+static int
+transmitLimit(void)
+{
+	int			n = nmembers + 1;
+	int			log2n = 0;
+
+	while (n > 1)
+	{
+		n >>= 1;
+		log2n++;
+	}
+
+	return 3 * Max(log2n, 1);
+}
+
+/*
+ * Remember that another member has had the given role.
+ */
+static void
+noteRole(GossipRole role)
+{
+	if ((unsigned int) role <= GOSSIP_ROLE_WITNESS)
+		roles_seen[role] = true;
+}
+
+/*
+ * We heard from the member itself, which beats any rumor about it.
+ */
+static void
+applyDirectContact(int idx, GossipRole role, uint32 incarnation, uint64 lsn)
+{
+	GossipMember *m = &members[idx].member;
+
+	if (incarnation < m->incarnation)
+		incarnation = m->incarnation;
+
+	if (m->state != GOSSIP_ALIVE || incarnation != m->incarnation)
+		setState(idx, GOSSIP_ALIVE, incarnation);
+
+	if (m->role != role)
+	{
+		m->role = role;
+		members[idx].transmits = transmitLimit();
+	}
+	noteRole(role);
+	m->lsn = lsn;
+}
+
+/*
+ * Merge a piggybacked update into our view.
+ */
+static void
+applyUpdate(const char *name, GossipState state, GossipRole role,
+			uint32 incarnation, uint64 lsn)
+{
+	int			idx = findMember(name);
+	GossipMember *m;
+
+	if (idx < 0)
+	{
+		if (state == GOSSIP_DEAD)
+			return;
+		if ((idx = addMember(name, state, incarnation, false)) < 0)
+			return;
+		members[idx].member.role = role;
+		members[idx].member.lsn = lsn;
+		noteRole(role);
+		return;
+	}
+
+	m = &members[idx].member;
+
+	/* Someone suspects us, refute it */
+	if (idx == 0)
+	{
+		if (state != GOSSIP_ALIVE && incarnation >= m->incarnation)
+		{
+			m->incarnation = incarnation + 1;
+			members[0].transmits = transmitLimit();
+			saveIncarnation(m->incarnation);
+		}
+		return;
+	}
+
+	if (incarnation > m->incarnation ||
+		(incarnation == m->incarnation && state > m->state))
+		setState(idx, state, incarnation);
+
+	if (incarnation >= m->incarnation)
+	{
+		m->role = role;
+		noteRole(role);
+		if (lsn > m->lsn)
+			m->lsn = lsn;
+	}
+}
+
+/*
+ * Send a message of the given type to member to. For PING_REQ, target is
+ * the member to probe; for a forwarded ACK, the member that answered.
+ */
+static void
+sendMessage(int to, int type, uint32 seq, int target)
+{
+	char		buf[GOSSIP_MAX_MSG_SIZE];
+	char	   *p = buf;
+	char	   *nupdates_p;
+	GossipMember *self = &members[0].member;
+	int			pending[GOSSIP_MAX_MEMBERS];
+	int			npending = 0;
+	int			nupdates;
+	int			i;
+
+	if (members[to].addrlen == 0 && !resolveMember(&members[to]))
+		return;
+
+	p = putU32(p, GOSSIP_MAGIC);
+	p = putU8(p, GOSSIP_PROTOCOL_VERSION);
+	p = putU8(p, (uint8) type);
+	nupdates_p = p;
+	p = putU8(p, 0);
+	p = putU32(p, seq);
+	p = putU64(p, next_msgno++);
+	p = putName(p, self->name);
+	p = putU8(p, (uint8) self->state);
+	p = putU8(p, (uint8) self->role);
+	p = putU32(p, self->incarnation);
+	p = putU64(p, self->lsn);
+	p = putName(p, target >= 0 ? members[target].member.name : "");
+
+	/* Piggyback the updates that have been disseminated the least */
+	for (i = 0; i < nmembers; i++)
+		if (members[i].transmits > 0 && i != to)
+			pending[npending++] = i;
+	qsort(pending, npending, sizeof(int), compareTransmits);
+
+	for (nupdates = 0; nupdates < npending && nupdates < GOSSIP_MAX_UPDATES; nupdates++)
+	{
+		GossipMember *m = &members[pending[nupdates]].member;
+
+		p = putName(p, m->name);
+		p = putU8(p, (uint8) m->state);
+		p = putU8(p, (uint8) m->role);
+		p = putU32(p, m->incarnation);
+		p = putU64(p, m->lsn);
+		members[pending[nupdates]].transmits--;
+	}
+	putU8(nupdates_p, (uint8) nupdates);
+
+	if (!computeMac(buf, p - buf, (uint8 *) p))
+		return;
+	p += GOSSIP_MAC_SIZE;
+
+	if (sendto(gossip_sock, buf, p - buf, 0,
+			   (struct sockaddr *) &members[to].addr, members[to].addrlen) < 0 &&
+		errno != EAGAIN && errno != EWOULDBLOCK)
+		gossip_log("gossip: could not send to \"%s\": %s",
+				   members[to].member.name, strerror(errno));
+}
+
+static void
+handleMessage(const char *buf, int len)
+{
+	const char *p = buf;
+	uint32		magic;
+	uint8		version;
+	uint8		type;
+	uint8		nupdates;
+	uint32		seq;
+	uint64		msgno;
+	uint8		mac[GOSSIP_MAC_SIZE];
+	uint8		diff = 0;
+	char		sender_name[GOSSIP_NAME_LEN];
+	uint8		sender_state;
+	uint8		sender_role;
+	uint32		sender_incarnation;
+	uint64		sender_lsn;
+	char		target_name[GOSSIP_NAME_LEN];
+	int			sender;
+	int			i;
+
+	if (len < GOSSIP_HEADER_SIZE + GOSSIP_MAC_SIZE)
+		return;
+
+	p = getU32(p, &magic);
+	p = getU8(p, &version);
+	if (magic != GOSSIP_MAGIC || version != GOSSIP_PROTOCOL_VERSION)
+		return;
+
+	/* Drop anything not sent by a member, comparing in constant time */
+	len -= GOSSIP_MAC_SIZE;
+	if (!computeMac(buf, len, mac))
+		return;
+	for (i = 0; i < GOSSIP_MAC_SIZE; i++)
+		diff |= mac[i] ^ (uint8) buf[len + i];
+	if (diff != 0)
+		return;
+
+	p = getU8(p, &type);
+	p = getU8(p, &nupdates);
+	p = getU32(p, &seq);
+	p = getU64(p, &msgno);
+	p = getName(p, sender_name);
+	p = getU8(p, &sender_state);
+	p = getU8(p, &sender_role);
+	p = getU32(p, &sender_incarnation);
+	p = getU64(p, &sender_lsn);
+	p = getName(p, target_name);
+
+	if (len < GOSSIP_HEADER_SIZE + nupdates * GOSSIP_UPDATE_SIZE ||
+		nupdates > GOSSIP_MAX_UPDATES || sender_name[0] == '\0')
+		return;
+
+	if ((sender = findMember(sender_name)) < 0 &&
+		(sender = addMember(sender_name, GOSSIP_ALIVE, sender_incarnation,
+							false)) < 0)
+		return;
+	if (sender == 0)
+		return;					/* talking to ourselves? */
+
+	/*
+	 * A replay, or reordered by the network, which we can do without.
+	 * Message numbers start again with every incarnation.
+	 */
+	if (sender_incarnation < members[sender].last_incarnation ||
+		(sender_incarnation == members[sender].last_incarnation &&
+		 msgno <= members[sender].last_msgno))
+		return;
+	members[sender].last_incarnation = sender_incarnation;
+	members[sender].last_msgno = msgno;
+
+	applyDirectContact(sender, (GossipRole) sender_role, sender_incarnation,
+					   sender_lsn);
+
+	for (i = 0; i < nupdates; i++)
+	{
+		char		name[GOSSIP_NAME_LEN];
+		uint8		state;
+		uint8		role;
+		uint32		incarnation;
+		uint64		lsn;
+
+		p = getName(p, name);
+		p = getU8(p, &state);
+		p = getU8(p, &role);
+		p = getU32(p, &incarnation);
+		p = getU64(p, &lsn);
+
+		if (name[0] != '\0' && state <= GOSSIP_DEAD)
+			applyUpdate(name, (GossipState) state, (GossipRole) role,
+						incarnation, lsn);
+	}
+
+	/* Making room for new members may have moved the sender */
+	sender = findMember(sender_name);
+
+	switch (type)
+	{
+		case GOSSIP_MSG_PING:
+			sendMessage(sender, GOSSIP_MSG_ACK, seq, -1);
+			break;
+
+		case GOSSIP_MSG_PING_REQ:
+			{
+				int			target = findMember(target_name);
+
+				if (target <= 0)
+					break;
+
+				for (i = 0; i < GOSSIP_MAX_RELAYS; i++)
+				{
+					if (relays[i].used)
+						continue;
+
+					relays[i].used = true;
+					relays[i].seq = next_seq++;
+					relays[i].target = target;
+					relays[i].origin = sender;
+					relays[i].origin_seq = seq;
+					relays[i].expires = gossipNow() +
+						(uint64) pgkeeper_gossip_interval * 1000;
+					sendMessage(target, GOSSIP_MSG_PING, relays[i].seq, -1);
+					break;
+				}
+			}
+			break;
+
+		case GOSSIP_MSG_ACK:
+			if (target_name[0] != '\0')
+			{
+				/* An ACK forwarded by a member we sent PING_REQ to */
+				if (probe_phase != PROBE_NONE && seq == probe_seq &&
+					strcmp(target_name, members[probe_target].member.name) == 0)
+					probeAcked();
+				break;
+			}
+
+			if (probe_phase != PROBE_NONE && seq == probe_seq &&
+				sender == probe_target)
+				probeAcked();
+
+			for (i = 0; i < GOSSIP_MAX_RELAYS; i++)
+			{
+				if (relays[i].used && relays[i].seq == seq &&
+					relays[i].target == sender)
+				{
+					sendMessage(relays[i].origin, GOSSIP_MSG_ACK,
+								relays[i].origin_seq, sender);
+					relays[i].used = false;
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * Start the probe of a new protocol period.
+ */
+static void
+startProbe(uint64 now)
+{
+	probe_phase = PROBE_NONE;
+
+	if ((probe_target = nextProbeTarget()) < 0)
+		return;
+
+	probe_seq = next_seq++;
+	probe_phase = PROBE_DIRECT;
+
+	/* Leave the rest of the period for indirect probing */
+	probe_deadline = now + (uint64) pgkeeper_gossip_interval * 1000 * 2 / 5;
+
+	sendMessage(probe_target, GOSSIP_MSG_PING, probe_seq, -1);
+}
+
+/*
+ * Pick the next member to probe. All members, including dead ones, are
+ * probed once per round in a random order reshuffled every round, so a
+ * dead member that comes back is noticed too.
+ */
+static int
+nextProbeTarget(void)
+{
+	int			i;
+
+	if (nmembers <= 1)
+		return -1;
+
+	if (probe_pos >= probe_norder)
+	{
+		probe_norder = 0;
+		for (i = 1; i < nmembers; i++)
+			probe_order[probe_norder++] = i;
+
+		/* Fisher-Yates shuffle */
+		for (i = probe_norder - 1; i > 0; i--)
+		{
+			int			j = random() % (i + 1);
+			int			tmp = probe_order[i];
+
+			probe_order[i] = probe_order[j];
+			probe_order[j] = tmp;
+		}
+		probe_pos = 0;
+	}
+
+	return probe_order[probe_pos++];
+}
+
+static void
+probeAcked(void)
+{
+	probe_phase = PROBE_NONE;
+}
+
+/* Sort member indexes by remaining transmits, most first */
+static int
+compareTransmits(const void *a, const void *b)
+{
+	return members[*(const int *) b].transmits -
+		members[*(const int *) a].transmits;
+}
+
+static char *
+putU8(char *p, uint8 v)
+{
+	*p = (char) v;
+	return p + 1;
+}
+
+static char *
+putU32(char *p, uint32 v)
+{
+	uint32		n = htonl(v);
+
+	memcpy(p, &n, 4);
+	return p + 4;
+}
+
+static char *
+putU64(char *p, uint64 v)
+{
+	p = putU32(p, (uint32) (v >> 32));
+	return putU32(p, (uint32) v);
+}
+
+static char *
+putName(char *p, const char *name)
+{
+	memset(p, 0, GOSSIP_NAME_LEN);
+	strlcpy(p, name, GOSSIP_NAME_LEN);
+	return p + GOSSIP_NAME_LEN;
+}
+
+static const char *
+getU8(const char *p, uint8 *v)
+{
+	*v = (uint8) *p;
+	return p + 1;
+}
+
+static const char *
+getU32(const char *p, uint32 *v)
+{
+	uint32		n;
+
+	memcpy(&n, p, 4);
+	*v = ntohl(n);
+	return p + 4;
+}
+
+static const char *
+getU64(const char *p, uint64 *v)
+{
+	uint32		hi;
+	uint32		lo;
+
+	p = getU32(p, &hi);
+	p = getU32(p, &lo);
+	*v = ((uint64) hi) << 32 | lo;
+	return p;
+}
+
+static const char *
+getName(const char *p, char *name)
+{
+	memcpy(name, p, GOSSIP_NAME_LEN);
+	name[GOSSIP_NAME_LEN - 1] = '\0';
+	return p + GOSSIP_NAME_LEN;
+}
+
+#if PG_VERSION_NUM >= 140000
+
+/*
+ * Set up the HMAC context with the shared secret.  In the backend, the
+ * context may need a resource owner, which must outlive any transaction.
+ */
+static bool
+setSecret(const char *secret)
+{
+#ifndef FRONTEND
+	MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+	if (hmac_ctx == NULL)
+	{
+		ResourceOwner oldowner = CurrentResourceOwner;
+
+		CurrentResourceOwner = ResourceOwnerCreate(NULL, "pg_keeper gossip");
+		hmac_ctx = pg_hmac_create(PG_SHA256);
+		CurrentResourceOwner = oldowner;
+	}
+#else
+	if (hmac_ctx == NULL)
+		hmac_ctx = pg_hmac_create(PG_SHA256);
+#endif
+
+	if (hmac_key != NULL)
+		pfree(hmac_key);
+	hmac_key = pstrdup(secret);
+
+#ifndef FRONTEND
+	MemoryContextSwitchTo(oldcontext);
+#endif
+
+	if (hmac_ctx == NULL)
+	{
+		gossip_log("gossip: could not create HMAC context");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Compute the HMAC-SHA-256 of the len bytes at buf into mac.
+ */
+static bool
+computeMac(const char *buf, int len, uint8 *mac)
+{
+	if (pg_hmac_init(hmac_ctx, (const uint8 *) hmac_key,
+					 strlen(hmac_key)) < 0 ||
+		pg_hmac_update(hmac_ctx, (const uint8 *) buf, len) < 0 ||
+		pg_hmac_final(hmac_ctx, mac, GOSSIP_MAC_SIZE) < 0)
+	{
+		gossip_log("gossip: could not compute HMAC");
+		return false;
+	}
+
+	return true;
+}
+
+#elif PG_VERSION_NUM >= 110000
+
+/*
+ * Prepare the HMAC pads from the shared secret, see RFC 2104.  Before
+ * PostgreSQL 14 there is only SHA-256 to build the HMAC on.
+ */
+static bool
+setSecret(const char *secret)
+{
+	uint8		key[PG_SHA256_BLOCK_LENGTH];
+	size_t		keylen = strlen(secret);
+	int			i;
+
+	memset(key, 0, sizeof(key));
+	if (keylen > PG_SHA256_BLOCK_LENGTH)
+	{
+		pg_sha256_ctx ctx;
+
+		pg_sha256_init(&ctx);
+		pg_sha256_update(&ctx, (const uint8 *) secret, keylen);
+		pg_sha256_final(&ctx, key);
+	}
+	else
+		memcpy(key, secret, keylen);
+
+	for (i = 0; i < PG_SHA256_BLOCK_LENGTH; i++)
+	{
+		key_ipad[i] = key[i] ^ 0x36;
+		key_opad[i] = key[i] ^ 0x5c;
+	}
+
+	return true;
+}
+
+/*
+ * Compute the HMAC-SHA-256 of the len bytes at buf into mac.
+ */
+static bool
+computeMac(const char *buf, int len, uint8 *mac)
+{
+	pg_sha256_ctx ctx;
+	uint8		inner[PG_SHA256_DIGEST_LENGTH];
+
+	pg_sha256_init(&ctx);
+	pg_sha256_update(&ctx, key_ipad, PG_SHA256_BLOCK_LENGTH);
+	pg_sha256_update(&ctx, (const uint8 *) buf, len);
+	pg_sha256_final(&ctx, inner);
+
+	pg_sha256_init(&ctx);
+	pg_sha256_update(&ctx, key_opad, PG_SHA256_BLOCK_LENGTH);
+	pg_sha256_update(&ctx, inner, sizeof(inner));
+	pg_sha256_final(&ctx, mac);
+
+	return true;
+}
+
+#else
+
+static bool
+setSecret(const char *secret)
+{
+	gossip_log("gossip: requires PostgreSQL 11 or later");
+	return false;
+}
+
+static bool
+computeMac(const char *buf, int len, uint8 *mac)
+{
+	return false;
+}
+
+#endif
+
+/*
+ * Return the incarnation to start with: one past the one recorded in the
+ * state file, if any, and record it there.  It is at least the time, so
+ * that we still override a previous run without a state file; without
+ * one, that only works as long as the clock doesn't step back.
+ */
+static uint32
+startIncarnation(void)
+{
+	uint32		incarnation = (uint32) time(NULL);
+	unsigned int last;
+	FILE	   *fp;
+
+	if (state_path[0] == '\0')
+		return incarnation;
+
+	if ((fp = fopen(state_path, "r")) != NULL)
+	{
+		if (fscanf(fp, "%u", &last) == 1 && last >= incarnation)
+			incarnation = last + 1;
+		fclose(fp);
+	}
+	else if (errno != ENOENT)
+		gossip_log("gossip: could not open \"%s\": %s", state_path,
+				   strerror(errno));
+
+	saveIncarnation(incarnation);
+
+	return incarnation;
+}
+
+/*
+ * Record our incarnation in the state file, replacing it atomically.
+ */
+static void
+saveIncarnation(uint32 incarnation)
+{
+	char		tmppath[MAXPGPATH + 4];
+	char		buf[16];
+	int			fd;
+	int			len;
+
+	if (state_path[0] == '\0')
+		return;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", state_path);
+	len = snprintf(buf, sizeof(buf), "%u\n", incarnation);
+
+	if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+	{
+		gossip_log("gossip: could not create \"%s\": %s", tmppath,
+				   strerror(errno));
+		return;
+	}
+
+	if (write(fd, buf, len) != len || fsync(fd) != 0)
+	{
+		gossip_log("gossip: could not write \"%s\": %s", tmppath,
+				   strerror(errno));
+		close(fd);
+		return;
+	}
+
+	if (close(fd) != 0 || rename(tmppath, state_path) != 0)
+		gossip_log("gossip: could not write \"%s\": %s", state_path,
+				   strerror(errno));
+}
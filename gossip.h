@@ -0,0 +1,61 @@
+/* -------------------------------------------------------------------------
+ *
+ * gossip.h
+ *
+ * SWIM-style gossip membership for pg_keeper.
+ *
+ * This is shared by the pg_keeper worker and frontend programs, so it
+ * must only rely on c.h and libpgcommon.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef GOSSIP_H
+#define GOSSIP_H
+
+#define GOSSIP_MAX_MEMBERS		32
+#define GOSSIP_NAME_LEN			64		/* "host:port" */
+
+typedef enum GossipState
+{
+	GOSSIP_ALIVE = 0,
+	GOSSIP_SUSPECT,
+	GOSSIP_DEAD
+} GossipState;
+
+typedef enum GossipRole
+{
+	GOSSIP_ROLE_UNKNOWN = 0,
+	GOSSIP_ROLE_MASTER,
+	GOSSIP_ROLE_STANDBY,
+	GOSSIP_ROLE_WITNESS
+} GossipRole;
+
+/* A member as seen by this node */
+typedef struct GossipMember
+{
+	char		name[GOSSIP_NAME_LEN];	/* also its gossip address */
+	GossipState	state;
+	GossipRole	role;
+	uint32		incarnation;	/* bumped by the member to refute suspicion */
+	uint64		lsn;			/* WAL position last heard of */
+	uint64		state_since;	/* when state last changed, monotonic usec */
+} GossipMember;
+
+/* Settings, also used as GUC variables by the pg_keeper worker */
+extern int	pgkeeper_gossip_interval;
+extern int	pgkeeper_gossip_indirect_checks;
+
+extern bool gossipInit(const char *self, const char *seeds,
+					   const char *secret, const char *state_file);
+extern int	gossipSocket(void);
+extern void gossipReceive(void);
+extern void gossipRun(void);
+extern long gossipTimeout(void);
+extern void gossipSetSelf(GossipRole role, uint64 lsn);
+extern int	gossipGetMembers(GossipMember *members, int max);
+extern bool gossipRoleIsAlive(GossipRole role);
+extern bool gossipRoleWasSeen(GossipRole role);
+extern const char *gossipStateName(GossipState state);
+extern const char *gossipRoleName(GossipRole role);
+
+#endif							/* GOSSIP_H */
@@ -29,21 +29,36 @@
 #include "executor/spi.h"
 #include "libpq-int.h"
 #include "tcop/utility.h"
+#include "utils/memutils.h"
 #include "utils/snapmgr.h"
 #include "utils/ps_status.h"
 
 #include "pgstat.h"
 
 #define SQL_CHANGE_TO_ASYNC			"ALTER SYSTEM SET synchronous_standby_names TO '';"
+#define SQL_GRANT_LEASE				"SELECT pg_keeper_grant_lease(%d)"
+#define SQL_FENCE					"ALTER SYSTEM SET default_transaction_read_only TO on"
+#define SQL_UNFENCE					"ALTER SYSTEM RESET default_transaction_read_only"
+#define SQL_TERMINATE_CLIENTS \
+	"SELECT pg_terminate_backend(pid) " SQL_CLIENT_BACKENDS
 
 bool	KeeperMainMaster(void);
 void	setupKeeperMaster(void);
+void	fenceMaster(void);
+void	unfenceMaster(void);
 
 static void changeToAsync(void);
 static bool checkStandbyIsConnected(void);
+static void renewLease(void);
+static long leaseTimeout(long timeout);
+static long pollTimeout(void);
+static void reloadConfig(void);
+static void checkStaleMaster(void);
+static uint64 partnerDeadline(void);
 
 /* Variables for heartbeat */
 static int retry_count;
+static uint64 next_poll;	/* when to poll the standby next */
 
 /* GUC variables */
 char	*keeper_node1_conninfo;
@@ -51,15 +66,61 @@ char	*keeper_node1_conninfo;
 /* Other variables */
 bool	standby_connected;
 
-/* Set up several parameters for master mode */
+/*
+ * Set up several parameters for master mode. When resuming, carry on
+ * with the state left in shared memory instead.
+ */
 void
 setupKeeperMaster()
 {
+	if (keeperResumed)
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper resumes master mode")));
+
+		retry_count = keeperShmem->stats.retry_count;
+		next_poll = keeperMonotonicUsec();
+
+		/*
+		 * We may have failed half way through fencing, so do it again.
+		 * Otherwise make sure we are not stale before announcing
+		 * ourselves as a writable master.
+		 */
+		if (keeperShmem->fenced)
+			fenceMaster();
+		else
+		{
+			checkStaleMaster();
+			if (!keeperShmem->fenced)
+				updateStatus(KEEPER_MASTER_READY);
+		}
+		return;
+	}
+
 	/* Set up variable */
 	retry_count = 0;
+	next_poll = keeperMonotonicUsec() + (uint64) pgkeeper_keepalives_time * 1000000;
+
+	/*
+	 * Give the standby one lease period to grant us a lease. If we are
+	 * already read-only, consider ourselves fenced until it does.
+	 */
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->lease_expiry = keeperMonotonicUsec() +
+		(uint64) pgkeeper_lease_time * 1000;
+	keeperShmem->fenced = pgkeeper_lease_time > 0 && DefaultXactReadOnly;
+	keeperShmem->stale_master = false;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	/*
+	 * If we are coming back after a failover, the partner is now the
+	 * master and we must not accept writes. Find out before announcing
+	 * ourselves, see publishEndpoint().
+	 */
+	checkStaleMaster();
 
 	/* Set process display which is exposed by ps command */
-	updateStatus(KEEPER_MASTER_READY);
+	updateStatus(keeperShmem->fenced ? KEEPER_MASTER_FENCED : KEEPER_MASTER_READY);
 
 	/*
 	 * There migth be a entry in this server if this server is
@@ -92,29 +153,36 @@ KeeperMainMaster(void)
 		 * instead, they may wait on their process latch, which sleeps as
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
+		 * keeperWaitLatch() also keeps the gossip membership going.
 		 */
-#if PG_VERSION_NUM >= 100000
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pgkeeper_keepalives_time * 1000L,
-					   PG_WAIT_EXTENSION);
-#else
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pgkeeper_keepalives_time * 1000L);
-#endif
+		rc = keeperWaitLatch(leaseTimeout(pollTimeout()));
 		ResetLatch(&MyProc->procLatch);
 
 		/* Emergency bailout if postmaster has died */
 		if (rc & WL_POSTMASTER_DEATH)
 			return false;
 
+		/* Forget whatever the previous iteration allocated */
+		MemoryContextSwitchTo(KeeperLoopContext);
+		MemoryContextReset(KeeperLoopContext);
+
 		/* If got SIGHUP, reload the configuration file */
 		if (got_sighup)
 		{
+			int		old_lease_time = pgkeeper_lease_time;
+
 			got_sighup = false;
 			ProcessConfigFile(PGC_SIGHUP);
 
+			/* Just enabled, give the standby one lease period to grant one */
+			if (old_lease_time == 0 && pgkeeper_lease_time > 0)
+			{
+				SpinLockAcquire(&keeperShmem->mutex);
+				keeperShmem->lease_expiry = keeperMonotonicUsec() +
+					(uint64) pgkeeper_lease_time * 1000;
+				SpinLockRelease(&keeperShmem->mutex);
+			}
+
 			/*
 			 * If we change async mode to sync mode , always reset standby_connected.
 			 * Also if we change sync mode to async mode, reset it.
@@ -149,6 +217,49 @@ KeeperMainMaster(void)
 			}
 		}
 
+		/*
+		 * Hand over to the standby if pg_keeper_switchover() asked us to.
+		 * Once it has been promoted, we are a stale master just as after
+		 * a failover, except that our rejoin is already on its way.
+		 */
+		if (keeperShmem->switchover_state == SWITCHOVER_REQUESTED)
+		{
+			if (keeperShmem->stale_master)
+			{
+				ereport(LOG,
+						(errmsg("pg_keeper refuses switchover, the partner server is already the master")));
+				finishSwitchover(SWITCHOVER_FAILED);
+			}
+			else if (runSwitchover())
+			{
+				SpinLockAcquire(&keeperShmem->mutex);
+				keeperShmem->stale_master = true;
+				SpinLockRelease(&keeperShmem->mutex);
+			}
+		}
+
+		/*
+		 * Renew our lease from the standby, fencing ourselves if it has
+		 * expired. This must come first since it is time critical.
+		 */
+		if (pgkeeper_lease_time > 0)
+			renewLease();
+
+		/*
+		 * The rest is done every keepalives_time, however often the lease
+		 * wakes us up, so that keepalives_count keeps its meaning.
+		 */
+		if (keeperMonotonicUsec() < next_poll)
+			continue;
+		next_poll = keeperMonotonicUsec() + (uint64) pgkeeper_keepalives_time * 1000000;
+
+		/*
+		 * While fenced, the standby may have been promoted, e.g. after a
+		 * switchover that didn't see it happen in time.
+		 */
+		if (keeperShmem->fenced)
+			checkStaleMaster();
+
 		/*
 		 * We get started pooling to synchronous standby server
 		 * after a standby server connected to master server.
@@ -164,14 +275,20 @@ KeeperMainMaster(void)
 			 */
 			if (standby_connected)
 			{
-				if (keeperShmem->sync_mode)
-					updateStatus(KEEPER_MASTER_CONNECTED);
-				else
-					updateStatus(KEEPER_MASTER_ASYNC);
+				/* If fenced, stay so until the lease is renewed */
+				if (!keeperShmem->fenced)
+				{
+					if (keeperShmem->sync_mode)
+						updateStatus(KEEPER_MASTER_CONNECTED);
+					else
+						updateStatus(KEEPER_MASTER_ASYNC);
+				}
 
 				ereport(LOG, (errmsg("the standby server connected to the master server")));
 				retry_count = 0;
 			}
+			else
+				checkStaleMaster();
 		}
 		else if (keeperShmem->sync_mode)
 		{
@@ -179,7 +296,8 @@ KeeperMainMaster(void)
 			 * Pooling to standby server. If heartbeat is failed,
 			 * increment retry_count.
 			 */
-			if (!heartbeatServer(pgkeeper_partner_conninfo, retry_count))
+			if (!heartbeatServerBefore(pgkeeper_partner_conninfo, retry_count,
+									   partnerDeadline()))
 				retry_count++;
 			else
 				retry_count = 0; /* reset count */
@@ -197,13 +315,16 @@ KeeperMainMaster(void)
 				 * After changing to asynchronou replication, reset
 				 * state of itself and restart pooling.
 				 */
-				updateStatus(KEEPER_MASTER_ASYNC);
+				if (!keeperShmem->fenced)
+					updateStatus(KEEPER_MASTER_ASYNC);
 				standby_connected = false;
 			}
 		}
 		/* nothing to do if in async mode */
 	}
 
+	MemoryContextSwitchTo(TopMemoryContext);
+
 	return false;
 }
 
@@ -214,8 +335,6 @@ KeeperMainMaster(void)
 static void
 changeToAsync(void)
 {
-	int ret;
-
 	elog(LOG, "pg_keeper changes replication mode to asynchronous replication");
 
 	if (!execSQL(pgkeeper_my_conninfo, SQL_CHANGE_TO_ASYNC))
@@ -223,9 +342,11 @@ changeToAsync(void)
 				(errmsg("failed to execute ALTER SYSTEM to change to asynchronous replication")));
 
 	/* Then, send SIGHUP signal to Postmaster process */
-	if ((ret = kill(PostmasterPid, SIGHUP)) != 0)
-		ereport(ERROR,
-				(errmsg("failed to send SIGHUP signal to postmaster process : %d", ret)));
+	reloadConfig();
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->stats.async_changes++;
+	SpinLockRelease(&keeperShmem->mutex);
 }
 
 /*
@@ -237,6 +358,7 @@ checkStandbyIsConnected()
 {
 	int ret;
 	bool found;
+	MemoryContext oldcontext = CurrentMemoryContext;
 	StringInfo sql = makeStringInfo();
 
 	appendStringInfo(sql, "SELECT * FROM pg_stat_replication");
@@ -266,5 +388,234 @@ checkStandbyIsConnected()
 	PopActiveSnapshot();
 	CommitTransactionCommand();
 
+	/*
+	 * Committing leaves us in TopMemoryContext, go back to the caller's
+	 * context so that subsequent allocations get released as well.
+	 */
+	MemoryContextSwitchTo(oldcontext);
+
 	return found;
 }
+
+/*
+ * Ask the standby to renew our lease.
+ *
+ * The standby promises not to promote itself until lease_time plus a
+ * margin has passed since it last granted us a lease, and stops granting
+ * once it has decided to promote. We count our lease from before sending
+ * the request, so it always runs out before the standby may promote. Only
+ * intervals on monotonic clocks are compared, so the clocks of the two
+ * servers need not agree.
+ *
+ * The request is given up when our lease runs out, so that a standby that
+ * doesn't answer can't keep us accepting writes beyond it. A master we
+ * promoted doesn't enforce the lease until a standby has granted one.
+ */
+static void
+renewLease(void)
+{
+	uint64	sent_at = keeperMonotonicUsec();
+	uint64	expiry = sent_at + (uint64) pgkeeper_lease_time * 1000;
+	bool	holding;
+	char	*granted;
+	char	sql[128];
+
+	/* We may have been busy with something else until past the expiry */
+	if (!keeperShmem->fenced && !keeperShmem->lease_pending &&
+		sent_at >= keeperShmem->lease_expiry)
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper could not renew the lease from the standby server in time")));
+		fenceMaster();
+	}
+
+	holding = !keeperShmem->fenced && !keeperShmem->lease_pending;
+
+	/* The standby waits out the lease we count on, not its own setting */
+	snprintf(sql, sizeof(sql), SQL_GRANT_LEASE, pgkeeper_lease_time);
+	granted = execSQLValueBefore(pgkeeper_partner_conninfo, sql,
+								 holding ? keeperShmem->lease_expiry : expiry);
+
+	if (granted != NULL && strcmp(granted, "t") == 0)
+	{
+		SpinLockAcquire(&keeperShmem->mutex);
+		keeperShmem->lease_expiry = expiry;
+		keeperShmem->lease_pending = false;
+		SpinLockRelease(&keeperShmem->mutex);
+
+		/* Unless the answer came too late to be of use */
+		if (keeperShmem->fenced && !keeperShmem->stale_master &&
+			keeperMonotonicUsec() < expiry)
+			unfenceMaster();
+	}
+	else if (!keeperShmem->fenced && !keeperShmem->lease_pending &&
+			 keeperMonotonicUsec() >= keeperShmem->lease_expiry)
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper could not renew the lease from the standby server")));
+		fenceMaster();
+	}
+}
+
+/*
+ * Shorten the given timeout (in ms) so that we renew our lease when half
+ * of it is left, which leaves room for a slow round trip or two retries.
+ */
+static long
+leaseTimeout(long timeout)
+{
+	uint64	now;
+	uint64	left;
+	uint64	half = (uint64) pgkeeper_lease_time * 1000 / 2;
+
+	if (pgkeeper_lease_time == 0 || keeperShmem->fenced ||
+		keeperShmem->lease_pending)
+		return timeout;
+
+	now = keeperMonotonicUsec();
+	left = keeperShmem->lease_expiry > now ? keeperShmem->lease_expiry - now : 0;
+
+	if (left > half)
+		return Min(timeout, (long) ((left - half) / 1000) + 1);
+
+	/* The renewal failed, retry a few times before the lease runs out */
+	return Min(timeout, Max(pgkeeper_lease_time / 8, 1));
+}
+
+/*
+ * Return the time (in ms) until we poll the standby next.
+ */
+static long
+pollTimeout(void)
+{
+	uint64	now = keeperMonotonicUsec();
+
+	if (now >= next_poll)
+		return 0;
+
+	return (long) ((next_poll - now) / 1000) + 1;
+}
+
+/*
+ * Stop accepting writes, since the standby might promote itself now.
+ * From the moment the fenced flag is set, no backend can commit a write
+ * transaction, see pgkeeper_xact_callback(). New transactions are made
+ * read-only by default, and all client backends are terminated, so that
+ * no session is left that is in a write transaction or has overridden
+ * the default.
+ */
+void
+fenceMaster(void)
+{
+	char	sql[512];
+
+	ereport(LOG,
+			(errmsg("pg_keeper fences the master server")));
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->fenced = true;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	updateStatus(KEEPER_MASTER_FENCED);
+
+	if (!execSQL(pgkeeper_my_conninfo, SQL_FENCE))
+		ereport(ERROR,
+				(errmsg("failed to execute ALTER SYSTEM to fence the master server")));
+
+	reloadConfig();
+
+	/* Spare the session waiting for a switchover to report to it */
+	snprintf(sql, sizeof(sql), SQL_TERMINATE_CLIENTS,
+			 (int) switchoverRequester());
+	if (!execSQL(pgkeeper_my_conninfo, sql))
+		ereport(LOG,
+				(errmsg("failed to terminate client backends")));
+}
+
+/*
+ * The standby granted us a lease again, which means it has not been
+ * promoted. Accept writes again.
+ */
+void
+unfenceMaster(void)
+{
+	ereport(LOG,
+			(errmsg("pg_keeper renewed the lease from the standby server, unfencing the master server")));
+
+	if (!execSQL(pgkeeper_my_conninfo, SQL_UNFENCE))
+		ereport(ERROR,
+				(errmsg("failed to execute ALTER SYSTEM to unfence the master server")));
+
+	reloadConfig();
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->fenced = false;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	if (!standby_connected)
+		updateStatus(KEEPER_MASTER_READY);
+	else if (keeperShmem->sync_mode)
+		updateStatus(KEEPER_MASTER_CONNECTED);
+	else
+		updateStatus(KEEPER_MASTER_ASYNC);
+}
+
+/*
+ * Send SIGHUP signal to Postmaster process to make ALTER SYSTEM
+ * take effect.
+ */
+static void
+reloadConfig(void)
+{
+	int ret;
+
+	if ((ret = kill(PostmasterPid, SIGHUP)) != 0)
+		ereport(ERROR,
+				(errmsg("failed to send SIGHUP signal to postmaster process : %d", ret)));
+}
+
+/*
+ * Check whether the partner has been promoted on a newer timeline while
+ * we were away, in which case we are a stale master. Fence ourselves and,
+ * if pg_keeper.auto_rejoin is enabled, rejoin as a standby of the partner.
+ * Once found stale, we stay so until the server is restarted.
+ */
+static void
+checkStaleMaster(void)
+{
+	if (keeperShmem->stale_master || !partnerIsNewerMaster(partnerDeadline()))
+		return;
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->stale_master = true;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	if (!keeperShmem->fenced)
+		fenceMaster();
+
+	if (pgkeeper_auto_rejoin)
+		startRejoin();
+	else
+		ereport(LOG,
+				(errmsg("pg_keeper keeps the stale master server fenced"),
+				 errhint("Rebuild this server as a standby of the partner server, or enable pg_keeper.auto_rejoin.")));
+}
+
+/*
+ * Return when to give up a request to the standby.  Not after one polling
+ * interval, and while we hold a lease not after it expires either, so
+ * that a standby that doesn't answer can't keep us from fencing ourselves
+ * in time.
+ */
+static uint64
+partnerDeadline(void)
+{
+	uint64	deadline = keeperMonotonicUsec() +
+		(uint64) pgkeeper_keepalives_time * 1000000;
+
+	if (pgkeeper_lease_time > 0 && !keeperShmem->fenced &&
+		!keeperShmem->lease_pending)
+		deadline = Min(deadline, keeperShmem->lease_expiry);
+
+	return deadline;
+}
@@ -0,0 +1,39 @@
+/* pg_keeper--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_keeper" to load this file. \quit
+
+-- Called by the master's pg_keeper on the standby to renew its lease
+CREATE FUNCTION pg_keeper_grant_lease(ms integer)
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+-- Gossip membership as seen by the pg_keeper worker of this server
+CREATE FUNCTION pg_keeper_members(
+    OUT name text,
+    OUT state text,
+    OUT role text,
+    OUT incarnation bigint,
+    OUT lsn pg_lsn)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+-- Hand the master role over to the standby, called on the master
+CREATE FUNCTION pg_keeper_switchover(
+    OUT phase text,
+    OUT duration_ms float8)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+-- Called by the master's pg_keeper on the standby during a switchover
+CREATE FUNCTION pg_keeper_promote()
+RETURNS bool
+AS 'MODULE_PATHNAME'
+LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION pg_keeper_grant_lease(integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_keeper_switchover() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_keeper_promote() FROM PUBLIC;
@@ -9,6 +9,8 @@
 
 #include "postgres.h"
 
+#include <time.h>
+
 #include "pg_keeper.h"
 
 /* These are always necessary for a bgworker */
@@ -22,8 +24,17 @@
 #include "storage/proc.h"
 #include "storage/shmem.h"
 #include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
 #include "utils/ps_status.h"
 
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "funcapi.h"
+#include "pgstat.h"
+
 /* these headers are used by this particular worker's code */
 #include "tcop/utility.h"
 #include "libpq-int.h"
@@ -32,16 +43,59 @@ PG_MODULE_MAGIC;
 
 #define HEARTBEAT_SQL "SELECT 1"
 
+/*
+ * Like HEARTBEAT_SQL, this must succeed on any server that is up, whether
+ * or not it is in recovery; only a master has a WAL position to report.
+ */
+#if PG_VERSION_NUM >= 100000
+#define HEARTBEAT_LSN_SQL \
+	"SELECT CASE WHEN pg_is_in_recovery() THEN NULL ELSE pg_current_wal_lsn() END"
+#else
+#define HEARTBEAT_LSN_SQL \
+	"SELECT CASE WHEN pg_is_in_recovery() THEN NULL ELSE pg_current_xlog_location() END"
+#endif
+
+/* Our gossip incarnation, see gossipInit() */
+#define GOSSIP_STATE_FILE	"pg_keeper.gossip"
+
+/* Longest we leave gossip messages unanswered while waiting for a server */
+#define GOSSIP_POLL_TIMEOUT	10
+
 void	_PG_init(void);
 void	KeeperMain(Datum);
 bool	heartbeatServer(const char *conninfo, int r_count);
+bool	heartbeatServerBefore(const char *conninfo, int r_count, uint64 deadline);
+bool	heartbeatServerGetLSN(const char *conninfo, int r_count, XLogRecPtr *lsn);
 bool	execSQL(const char *conninfo, const char *sql);
+char	*execSQLValue(const char *conninfo, const char *sql);
+char	*execSQLValueBefore(const char *conninfo, const char *sql, uint64 deadline);
+PGconn	*connectBefore(const char *conninfo, uint64 deadline);
+bool	execQueryBefore(PGconn *con, const char *sql, uint64 deadline,
+						char **value);
+uint64	keeperMonotonicUsec(void);
+TimeLineID	keeperTimeLine(void);
+int		keeperWaitLatch(long timeout);
 
-static void checkParameter(void);
+static void runGossip(void);
+static bool doHeartbeat(const char *conninfo, const char *sql, int r_count,
+						uint64 deadline, char **value);
+static bool execSQLInternal(const char *conninfo, const char *sql, char **value);
+static bool execSQLBeforeInternal(const char *conninfo, const char *sql,
+								  uint64 deadline, char **value);
+static bool waitForSocket(PGconn *con, int events, uint64 deadline);
+
+static bool checkParameter(void);
+static bool parameterError(const char *message);
 static char *getStatusPsString(KeeperStatus status);
+static bool isWritableStatus(KeeperStatus status);
+static bool isMasterStatus(KeeperStatus status);
 
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static void pgkeeper_shmem_startup(void);
+static void pgkeeper_shmem_exit(int code, Datum arg);
+static void pgkeeper_xact_callback(XactEvent event, void *arg);
+
+PG_FUNCTION_INFO_V1(pg_keeper_members);
 
 /* Function for signal handler */
 static void pgkeeper_sigterm(SIGNAL_ARGS);
@@ -56,9 +110,19 @@ int	pgkeeper_keepalives_time;
 int	pgkeeper_keepalives_count;
 char *pgkeeper_partner_conninfo;
 char *pgkeeper_my_conninfo;
+char *pgkeeper_gossip_address;
+char *pgkeeper_gossip_seeds;
+char *pgkeeper_gossip_secret;
+int	pgkeeper_restart_interval;
 
 KeeperShmem	*keeperShmem;
 
+/* Are we resuming with the detector state left in shared memory? */
+bool	keeperResumed = false;
+
+/* Memory context reset at every iteration of the main loops */
+MemoryContext KeeperLoopContext = NULL;
+
 /*
  * Entrypoint of this module.
  *
@@ -122,6 +186,268 @@ _PG_init(void)
 							   NULL,
 							   NULL);
 
+	DefineCustomIntVariable("pg_keeper.stall_timeout",
+							"Specific time without WAL streaming progress until restarting walreceiver",
+							"Zero disables the check.",
+							&pgkeeper_stall_timeout,
+							60,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.lease_time",
+							"Specific lease period the master server obtains from the standby server",
+							"Zero disables the lease protocol.",
+							&pgkeeper_lease_time,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.lease_margin",
+							"Specific time the standby server waits after the lease expired until promoting",
+							NULL,
+							&pgkeeper_lease_margin,
+							500,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_keeper.auto_rejoin",
+							 "Rejoin as a standby when the partner server has been promoted",
+							 NULL,
+							 &pgkeeper_auto_rejoin,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_keeper.replication_conninfo",
+							   "Connection information used as primary_conninfo when following a new master",
+							   "Host and port are taken from the connection information of the new master.",
+							   &pgkeeper_replication_conninfo,
+							   NULL,
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomBoolVariable("pg_keeper.failover_candidate",
+							 "Promote this standby server when the master server fails",
+							 "Otherwise follow the master server found among pg_keeper.peer_conninfos.",
+							 &pgkeeper_failover_candidate,
+							 true,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("pg_keeper.peer_conninfos",
+							   "Semicolon-separated connection information for the other servers",
+							   NULL,
+							   &pgkeeper_peer_conninfos,
+							   NULL,
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomBoolVariable("pg_keeper.sync_slots",
+							 "Keep copies of the master's physical replication slots on the standby",
+							 NULL,
+							 &pgkeeper_sync_slots,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_keeper.prewarm_interval",
+							"Specific time between fetching hot blocks from primary server",
+							"Zero disables pre-warming.",
+							&pgkeeper_prewarm_interval,
+							0,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.prewarm_blocks",
+							"Specific number of hot blocks fetched from primary server",
+							NULL,
+							&pgkeeper_prewarm_blocks,
+							16384,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.prewarm_io_budget",
+							"Specific number of blocks read per polling for pre-warming",
+							NULL,
+							&pgkeeper_prewarm_io_budget,
+							1024,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_keeper.gossip_address",
+							   "Address and port this server gossips membership on, as host:port",
+							   "Empty disables gossip membership.",
+							   &pgkeeper_gossip_address,
+							   NULL,
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_keeper.gossip_seeds",
+							   "Comma-separated gossip addresses of members to join through",
+							   NULL,
+							   &pgkeeper_gossip_seeds,
+							   NULL,
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_keeper.gossip_secret",
+							   "Secret shared by all gossip members to authenticate their messages",
+							   NULL,
+							   &pgkeeper_gossip_secret,
+							   NULL,
+							   PGC_POSTMASTER,
+							   GUC_SUPERUSER_ONLY | GUC_NOT_IN_SAMPLE,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_keeper.gossip_interval",
+							"Specific time between gossip probes of a member",
+							NULL,
+							&pgkeeper_gossip_interval,
+							1000,
+							10,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("pg_keeper.gossip_indirect_checks",
+							"Specific number of members asked to probe a member that did not answer",
+							NULL,
+							&pgkeeper_gossip_indirect_checks,
+							3,
+							0,
+							GOSSIP_MAX_MEMBERS,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("pg_keeper.require_witness",
+							 "Promote only when a gossip witness confirms the master server is lost",
+							 NULL,
+							 &pgkeeper_require_witness,
+							 false,
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("pg_keeper.switchover_timeout",
+							"Specific time a switchover may take until it is given up",
+							NULL,
+							&pgkeeper_switchover_timeout,
+							5000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("pg_keeper.endpoint",
+							   "Endpoint announced when this server becomes the master",
+							   "Empty disables the announcement.",
+							   &pgkeeper_endpoint,
+							   NULL,
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_keeper.endpoint_file",
+							   "File the endpoint is written to when this server becomes the master",
+							   NULL,
+							   &pgkeeper_endpoint_file,
+							   NULL,
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("pg_keeper.endpoint_socket",
+							   "Unix domain datagram socket the endpoint is sent to when this server becomes the master",
+							   NULL,
+							   &pgkeeper_endpoint_socket,
+							   NULL,
+							   PGC_SIGHUP,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("pg_keeper.restart_interval",
+							"Specific time until pg_keeper is restarted after it exited abnormally",
+							"-1 disables restarting.",
+							&pgkeeper_restart_interval,
+							1,
+							-1,
+							INT_MAX,
+							PGC_POSTMASTER,
+							GUC_UNIT_S,
+							NULL,
+							NULL,
+							NULL);
+
 	DefineCustomStringVariable("pg_keeper.after_command",
 							   "Shell command that will be called after promoted",
 							   NULL,
@@ -137,14 +463,22 @@ _PG_init(void)
     prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = pgkeeper_shmem_startup;
 
+	/* Enforce the fence in every backend, see pgkeeper_xact_callback() */
+	RegisterXactCallback(pgkeeper_xact_callback, NULL);
+
 	/* request additional sharedresource */
 	RequestAddinShmemSpace(MAXALIGN(sizeof(KeeperShmem)));
+#if PG_VERSION_NUM >= 90600
+	RequestNamedLWLockTranche("pg_keeper", 1);
+#else
+	RequestAddinLWLocks(1);
+#endif
 
 	/* set up common data for all our workers */
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
 		BGWORKER_BACKEND_DATABASE_CONNECTION;
 	worker.bgw_start_time = BgWorkerStart_ConsistentState;
-	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	worker.bgw_restart_time = pgkeeper_restart_interval;
 #if PG_VERSION_NUM >= 100000
 	strcpy(worker.bgw_library_name, "pg_keeper");
 	strcpy(worker.bgw_function_name, "KeeperMain");
@@ -185,12 +519,84 @@ pgkeeper_shmem_startup(void)
 	if (!found)
 	{
 		SpinLockInit(&keeperShmem->mutex);
+#if PG_VERSION_NUM >= 90600
+		keeperShmem->members_lock = &(GetNamedLWLockTranche("pg_keeper"))->lock;
+#else
+		keeperShmem->members_lock = LWLockAssign();
+#endif
 		keeperShmem->sync_mode = false;
+		memset(&keeperShmem->stats, 0, sizeof(KeeperStats));
+		keeperShmem->fenced = false;
+		keeperShmem->lease_pending = false;
+		keeperShmem->lease_granted_until = 0;
+		keeperShmem->lease_revoked = false;
+		keeperShmem->keeper_pid = 0;
+		keeperShmem->keeper_latch = NULL;
+		keeperShmem->switchover_state = SWITCHOVER_NONE;
+		keeperShmem->switchover_requester = 0;
+		keeperShmem->promote_requested = false;
+		keeperShmem->nmembers = 0;
+		keeperShmem->worker_starts = 0;
+		keeperShmem->lease_expiry = 0;
+		keeperShmem->stale_master = false;
+		keeperShmem->master_conninfo[0] = '\0';
 	}
 
 	LWLockRelease(AddinShmemInitLock);
 }
 
+/*
+ * Let backends know that we are gone, see pg_keeper_switchover().
+ */
+static void
+pgkeeper_shmem_exit(int code, Datum arg)
+{
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->keeper_pid = 0;
+	keeperShmem->keeper_latch = NULL;
+	SpinLockRelease(&keeperShmem->mutex);
+}
+
+/*
+ * Refuse to commit a transaction that wrote anything while the master is
+ * fenced.  default_transaction_read_only, set when fencing, is only a
+ * default that any session can override, so this is what actually keeps
+ * writes from being accepted once the standby may have been promoted.
+ *
+ * The worker only fences us once it gets round to it, so the lease is
+ * enforced here as well: once it has expired, the standby may promote
+ * at any moment whatever the worker is busy with.
+ */
+static void
+pgkeeper_xact_callback(XactEvent event, void *arg)
+{
+	uint64	now;
+	bool	refuse;
+
+	if (event != XACT_EVENT_PRE_COMMIT && event != XACT_EVENT_PRE_PREPARE)
+		return;
+
+	if (keeperShmem == NULL ||
+		!TransactionIdIsValid(GetTopTransactionIdIfAny()))
+		return;
+
+	now = keeperMonotonicUsec();
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	refuse = keeperShmem->fenced ||
+		(pgkeeper_lease_time > 0 &&
+		 isMasterStatus(keeperShmem->current_status) &&
+		 !keeperShmem->lease_pending && now >= keeperShmem->lease_expiry);
+	SpinLockRelease(&keeperShmem->mutex);
+
+	if (!refuse)
+		return;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+			 errmsg("cannot commit a write transaction while the master server is fenced by pg_keeper")));
+}
+
 /*
  * Signal handler for SIGTERM
  *		Set a flag to let the main loop to terminate, and set our latch to wake
@@ -227,13 +633,23 @@ pgkeeper_sighup(SIGNAL_ARGS)
 void
 KeeperMain(Datum main_arg)
 {
+	sigjmp_buf	local_sigjmp_buf;
 	int ret;
 
-	/* Sanity check */
-	checkParameter();
+	/*
+	 * Sanity check. This runs before we can recover from errors, and a
+	 * restarted worker would only fail the same way again, so give up
+	 * until the server restarts.
+	 */
+	if (!checkParameter())
+		proc_exit(0);
 
-	/* Determine keeper mode of itself */
-	updateStatus(RecoveryInProgress() ? KEEPER_STANDBY_READY : KEEPER_MASTER_READY);
+	/*
+	 * Determine keeper mode of itself. The master's status is settled by
+	 * setupKeeperMaster(), which knows whether we are fenced.
+	 */
+	if (RecoveryInProgress())
+		updateStatus(KEEPER_STANDBY_READY);
 
 	/* Establish signal handlers before unblocking signals */
 	pqsignal(SIGHUP, pgkeeper_sighup);
@@ -249,15 +665,105 @@ KeeperMain(Datum main_arg)
 	BackgroundWorkerInitializeConnection("postgres", NULL);
 #endif
 
+	/* Start publishing our status for external monitors */
+	openStatusFile();
+
+	/*
+	 * Let backends wake us up. If we have been running before, resume
+	 * with the detector state left in shared memory.
+	 */
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->keeper_pid = MyProcPid;
+	keeperShmem->keeper_latch = &MyProc->procLatch;
+	keeperResumed = keeperShmem->worker_starts++ > 0;
+	SpinLockRelease(&keeperShmem->mutex);
+	on_shmem_exit(pgkeeper_shmem_exit, (Datum) 0);
+
+	/* Join the gossip membership if configured */
+	if (pgkeeper_gossip_address != NULL && pgkeeper_gossip_address[0] != '\0')
+	{
+		char	state_file[MAXPGPATH];
+
+		snprintf(state_file, MAXPGPATH, "%s/%s", DataDir, GOSSIP_STATE_FILE);
+		if (!gossipInit(pgkeeper_gossip_address, pgkeeper_gossip_seeds,
+						pgkeeper_gossip_secret, state_file))
+		{
+			ereport(LOG,
+					(errmsg("could not start gossip membership on \"%s\"",
+							pgkeeper_gossip_address),
+					 errdetail("pg_keeper stops until the server restarts.")));
+			proc_exit(0);
+		}
+	}
+
+	/*
+	 * We run for as long as the server does, so anything allocated while
+	 * polling must not survive the iteration that allocated it.
+	 */
+#if PG_VERSION_NUM >= 90600
+	KeeperLoopContext = AllocSetContextCreate(TopMemoryContext,
+											  "pg_keeper loop",
+											  ALLOCSET_DEFAULT_SIZES);
+#else
+	KeeperLoopContext = AllocSetContextCreate(TopMemoryContext,
+											  "pg_keeper loop",
+											  ALLOCSET_DEFAULT_MINSIZE,
+											  ALLOCSET_DEFAULT_INITSIZE,
+											  ALLOCSET_DEFAULT_MAXSIZE);
+#endif
+
+	/*
+	 * If an error occurs, we come back here. Most errors are transient,
+	 * e.g. a failed ALTER SYSTEM, so rather than leaving the cluster
+	 * unwatched until the server restarts, report it, clean up, and
+	 * resume after one polling interval.
+	 */
+	if (sigsetjmp(local_sigjmp_buf, 1) != 0)
+	{
+		int		rc;
+
+		/* Since not using PG_TRY, must reset error stack by hand */
+		error_context_stack = NULL;
+
+		/* Prevent interrupts while cleaning up */
+		HOLD_INTERRUPTS();
+
+		EmitErrorReport();
+		AbortOutOfAnyTransaction();
+		LWLockReleaseAll();
+		FlushErrorState();
+		MemoryContextSwitchTo(TopMemoryContext);
+
+		RESUME_INTERRUPTS();
+
+		/* Whoever is waiting for a switchover must not wait forever */
+		cleanupSwitchover();
+
+		keeperResumed = true;
+
+		/* Don't spin on a persistent error */
+		rc = keeperWaitLatch(pgkeeper_keepalives_time * 1000L);
+		ResetLatch(&MyProc->procLatch);
+		if (rc & WL_POSTMASTER_DEATH || got_sigterm)
+			proc_exit(0);
+	}
+
+	/* We can now handle ereport(ERROR) */
+	PG_exception_stack = &local_sigjmp_buf;
+
 exec:
 
-	if (keeperShmem->current_status == KEEPER_MASTER_READY)
+	/* Resume only in the mode we were in, a promotion starts afresh */
+	keeperResumed = keeperResumed &&
+		isMasterStatus(keeperShmem->current_status) == !RecoveryInProgress();
+
+	if (!RecoveryInProgress())
 	{
 		/* Routine for master_mode */
 		setupKeeperMaster();
 		ret = KeeperMainMaster();
 	}
-	else if (keeperShmem->current_status == KEEPER_STANDBY_READY)
+	else
 	{
 		/* Routine for standby_mode */
 		setupKeeperStandby();
@@ -270,16 +776,201 @@ exec:
 		 */
 		if (ret)
 		{
+			/*
+			 * Wait for the promotion to complete, so that we go on as a
+			 * master that really accepts writes.
+			 */
+			while (RecoveryInProgress())
+			{
+				int		rc = keeperWaitLatch(10L);
+
+				ResetLatch(&MyProc->procLatch);
+				if (rc & WL_POSTMASTER_DEATH || got_sigterm)
+					proc_exit(0);
+			}
+
+			/*
+			 * Nobody can promote against us before a standby has granted
+			 * us a lease, so until then don't fence ourselves for lack
+			 * of one, e.g. while the old master is still down.
+			 */
+			SpinLockAcquire(&keeperShmem->mutex);
+			keeperShmem->lease_pending = true;
+			SpinLockRelease(&keeperShmem->mutex);
+
 			/* Change mode to master mode */
 			updateStatus(KEEPER_MASTER_READY);
 
+			/* Nothing to resume, the master's state starts afresh */
+			keeperResumed = false;
+
 			goto exec;
 		}
 	}
+
+	/* Returning means we were told to terminate, don't come back */
+	proc_exit(0);
+}
+
+/*
+ * Wait on our latch for at most timeout milliseconds, like WaitLatch()
+ * does.  Meanwhile keep the gossip membership going: answer the messages
+ * of other members and probe them in time.  Returns as soon as the latch
+ * is set or postmaster dies; the caller has to reset the latch.
+ */
+int
+keeperWaitLatch(long timeout)
+{
+	uint64	deadline = keeperMonotonicUsec() + (uint64) timeout * 1000;
+	int		rc;
+
+	for (;;)
+	{
+		uint64	now = keeperMonotonicUsec();
+		long	wait;
+
+		if (now >= deadline)
+			return WL_TIMEOUT;
+		wait = (long) ((deadline - now) / 1000) + 1;
+
+		if (gossipSocket() < 0)
+		{
+#if PG_VERSION_NUM >= 100000
+			return WaitLatch(&MyProc->procLatch,
+							 WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+							 wait,
+							 PG_WAIT_EXTENSION);
+#else
+			return WaitLatch(&MyProc->procLatch,
+							 WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+							 wait);
+#endif
+		}
+
+		wait = Min(wait, gossipTimeout());
+
+#if PG_VERSION_NUM >= 100000
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   WL_LATCH_SET | WL_SOCKET_READABLE | WL_TIMEOUT |
+							   WL_POSTMASTER_DEATH,
+							   gossipSocket(),
+							   wait,
+							   PG_WAIT_EXTENSION);
+#else
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   WL_LATCH_SET | WL_SOCKET_READABLE | WL_TIMEOUT |
+							   WL_POSTMASTER_DEATH,
+							   gossipSocket(),
+							   wait);
+#endif
+
+		if (rc & WL_SOCKET_READABLE)
+			gossipReceive();
+		runGossip();
+
+		if (rc & (WL_LATCH_SET | WL_POSTMASTER_DEATH))
+			return rc;
+	}
+}
+
+/*
+ * Advertise our role and WAL position, run the protocol, and expose the
+ * resulting view of the membership in shared memory.
+ */
+static void
+runGossip(void)
+{
+	GossipRole	role;
+	XLogRecPtr	lsn;
+
+	switch (keeperShmem->current_status)
+	{
+		case KEEPER_STANDBY_READY:
+		case KEEPER_STANDBY_CONNECTED:
+		case KEEPER_STANDBY_ALONE:
+			role = GOSSIP_ROLE_STANDBY;
+			break;
+		case KEEPER_MASTER_FENCED:
+			/* Not accepting writes, so it must not hold off a promotion */
+			role = GOSSIP_ROLE_UNKNOWN;
+			break;
+		default:
+			role = GOSSIP_ROLE_MASTER;
+			break;
+	}
+
+	if (RecoveryInProgress())
+		lsn = GetXLogReplayRecPtr(NULL);
 	else
-		ereport(ERROR, (errmsg("invalid keeper mode : \"%d\"", keeperShmem->current_status)));
+		lsn = GetXLogInsertRecPtr();
+
+	gossipSetSelf(role, lsn);
+	gossipRun();
+
+	LWLockAcquire(keeperShmem->members_lock, LW_EXCLUSIVE);
+	keeperShmem->nmembers = gossipGetMembers(keeperShmem->members,
+											 GOSSIP_MAX_MEMBERS);
+	LWLockRelease(keeperShmem->members_lock);
+}
+
+/*
+ * Return the gossip membership as seen by the pg_keeper worker.
+ */
+Datum
+pg_keeper_members(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	GossipMember *members;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 
-	proc_exit(ret);
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* Take a snapshot, the worker keeps updating the shared copy */
+		members = palloc(sizeof(GossipMember) * GOSSIP_MAX_MEMBERS);
+		LWLockAcquire(keeperShmem->members_lock, LW_SHARED);
+		funcctx->max_calls = keeperShmem->nmembers;
+		memcpy(members, keeperShmem->members,
+			   sizeof(GossipMember) * keeperShmem->nmembers);
+		LWLockRelease(keeperShmem->members_lock);
+		funcctx->user_fctx = members;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	members = (GossipMember *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		GossipMember *m = &members[funcctx->call_cntr];
+		Datum		values[5];
+		bool		nulls[5];
+		HeapTuple	tuple;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(m->name);
+		values[1] = CStringGetTextDatum(gossipStateName(m->state));
+		values[2] = CStringGetTextDatum(gossipRoleName(m->role));
+		values[3] = Int64GetDatum((int64) m->incarnation);
+		if (m->lsn == InvalidXLogRecPtr)
+			nulls[4] = true;
+		else
+			values[4] = LSNGetDatum(m->lsn);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
 }
 
 /*
@@ -292,7 +983,98 @@ exec:
 bool
 heartbeatServer(const char *conninfo, int r_count)
 {
-	if (!(execSQL(conninfo, HEARTBEAT_SQL)))
+	return doHeartbeat(conninfo, HEARTBEAT_SQL, r_count, 0, NULL);
+}
+
+/*
+ * heartbeatServerBefore()
+ *
+ * Same as heartbeatServer(), but the heartbeat fails once deadline, in
+ * terms of keeperMonotonicUsec(), has passed.  See execSQLValueBefore().
+ */
+bool
+heartbeatServerBefore(const char *conninfo, int r_count, uint64 deadline)
+{
+	return doHeartbeat(conninfo, HEARTBEAT_SQL, r_count, deadline, NULL);
+}
+
+/*
+ * heartbeatServerGetLSN()
+ *
+ * Same as heartbeatServer(), but also asks the server for its current WAL
+ * position and stores it in *lsn.  A server in recovery has none, it is
+ * alive all the same and *lsn is set to InvalidXLogRecPtr.
+ */
+bool
+heartbeatServerGetLSN(const char *conninfo, int r_count, XLogRecPtr *lsn)
+{
+	char	*value;
+	uint32	hi;
+	uint32	lo;
+
+	if (!doHeartbeat(conninfo, HEARTBEAT_LSN_SQL, r_count, 0, &value))
+		return false;
+
+	if (value == NULL)
+		*lsn = InvalidXLogRecPtr;
+	else if (sscanf(value, "%X/%X", &hi, &lo) != 2)
+	{
+		ereport(LOG,
+				(errmsg("could not parse WAL location \"%s\" received from server : \"%s\"",
+						value, conninfo)));
+		*lsn = InvalidXLogRecPtr;
+	}
+	else
+		*lsn = ((uint64) hi) << 32 | lo;
+
+	return true;
+}
+
+/*
+ * Do one heartbeat using the given sql, and account it in shared memory.
+ * If value is not NULL, the first column of the result is returned in it.
+ * A deadline of 0 means none.
+ */
+static bool
+doHeartbeat(const char *conninfo, const char *sql, int r_count,
+			uint64 deadline, char **value)
+{
+	uint64	start = keeperMonotonicUsec();
+	bool	ret;
+	uint64	latency;
+
+	if (deadline == 0)
+		ret = execSQLInternal(conninfo, sql, value);
+	else
+		ret = execSQLBeforeInternal(conninfo, sql, deadline, value);
+	latency = keeperMonotonicUsec() - start;
+
+	/* Account the heartbeat, then publish it */
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->stats.heartbeats++;
+	if (ret)
+	{
+		KeeperStats *stats = &keeperShmem->stats;
+
+		stats->retry_count = 0;
+		stats->latency_last = latency;
+		if (stats->latency_count == 0 || latency < stats->latency_min)
+			stats->latency_min = latency;
+		if (latency > stats->latency_max)
+			stats->latency_max = latency;
+		stats->latency_sum += latency;
+		stats->latency_count++;
+	}
+	else
+	{
+		keeperShmem->stats.heartbeat_failures++;
+		keeperShmem->stats.retry_count = r_count + 1;
+	}
+	SpinLockRelease(&keeperShmem->mutex);
+
+	publishStatusFile();
+
+	if (!ret)
 	{
 		ereport(LOG,
 				(errmsg("pg_keeper failed to connect %d time(s)", r_count + 1)));
@@ -307,10 +1089,39 @@ heartbeatServer(const char *conninfo, int r_count)
  */
 bool
 execSQL(const char *conninfo, const char *sql)
+{
+	return execSQLInternal(conninfo, sql, NULL);
+}
+
+/*
+ * Execute one SQL and return the first column of the first row, allocated
+ * in the current memory context.  Returns NULL on failure or if the query
+ * returned no rows.
+ */
+char *
+execSQLValue(const char *conninfo, const char *sql)
+{
+	char	*value;
+
+	if (!execSQLInternal(conninfo, sql, &value))
+		return NULL;
+
+	return value;
+}
+
+/*
+ * Workhorse for execSQL() and execSQLValue().  If value is not NULL, the
+ * first column of the first row (or NULL if there is none) is stored there.
+ */
+static bool
+execSQLInternal(const char *conninfo, const char *sql, char **value)
 {
 	PGconn		*con;
 	PGresult 	*res;
 
+	if (value)
+		*value = NULL;
+
 	/* Try to connect to primary server */
 	if ((con = PQconnectdb(conninfo)) == NULL)
 	{
@@ -338,6 +1149,10 @@ execSQL(const char *conninfo, const char *sql)
 		return false;
 	}
 
+	if (value && PQntuples(res) > 0 && PQnfields(res) > 0 &&
+		!PQgetisnull(res, 0, 0))
+		*value = pstrdup(PQgetvalue(res, 0, 0));
+
 	PQclear(res);
 
 	/* Primary server is alive now */
@@ -345,18 +1160,231 @@ execSQL(const char *conninfo, const char *sql)
 	return true;
 }
 
+/*
+ * Like execSQLValue(), but give up once deadline, in terms of
+ * keeperMonotonicUsec(), has passed.  Connecting and running the query
+ * are done asynchronously, so that neither a server that doesn't answer
+ * nor a half-open connection can hold us up beyond it.  Host names are
+ * still resolved synchronously, use hostaddr where that matters.
+ */
+char *
+execSQLValueBefore(const char *conninfo, const char *sql, uint64 deadline)
+{
+	char	*value;
+
+	if (!execSQLBeforeInternal(conninfo, sql, deadline, &value))
+		return NULL;
+
+	return value;
+}
+
+/*
+ * Workhorse for execSQLValueBefore() and heartbeatServerBefore(), like
+ * execSQLInternal() is for the functions without a deadline.
+ */
+static bool
+execSQLBeforeInternal(const char *conninfo, const char *sql, uint64 deadline,
+					  char **value)
+{
+	PGconn		*con;
+
+	if ((con = connectBefore(conninfo, deadline)) == NULL ||
+		!execQueryBefore(con, sql, deadline, value))
+	{
+		if (keeperMonotonicUsec() >= deadline)
+			ereport(LOG,
+					(errmsg("timed out getting tuple from server : \"%s\"",
+							conninfo)));
+		else
+			ereport(LOG,
+					(errmsg("could not get tuple from server : \"%s\"",
+							conninfo)));
+
+		PQfinish(con);
+		return false;
+	}
+
+	PQfinish(con);
+
+	return true;
+}
+
+/*
+ * Connect to the server at conninfo asynchronously, giving up once
+ * deadline has passed.  Returns NULL on failure, the caller reports it.
+ */
+PGconn *
+connectBefore(const char *conninfo, uint64 deadline)
+{
+	PGconn		*con;
+	PostgresPollingStatusType poll = PGRES_POLLING_WRITING;
+
+	if ((con = PQconnectStart(conninfo)) == NULL ||
+		PQstatus(con) == CONNECTION_BAD)
+		goto fail;
+
+	/* See PQconnectPoll(), we start as if it asked for writing */
+	while (poll != PGRES_POLLING_OK)
+	{
+		if (poll == PGRES_POLLING_FAILED ||
+			!waitForSocket(con, poll == PGRES_POLLING_READING ?
+						   WL_SOCKET_READABLE : WL_SOCKET_WRITEABLE,
+						   deadline))
+			goto fail;
+		poll = PQconnectPoll(con);
+	}
+
+	if (PQsetnonblocking(con, 1) != 0)
+		goto fail;
+
+	return con;
+
+fail:
+	PQfinish(con);
+
+	return NULL;
+}
+
+/*
+ * Run sql on con, a connection made by connectBefore(), giving up once
+ * deadline has passed.  If value is not NULL, the first column of the
+ * first row (or NULL if there is none) is stored there.  Returns false on
+ * failure, the caller reports it; con is of no more use then.
+ */
+bool
+execQueryBefore(PGconn *con, const char *sql, uint64 deadline, char **value)
+{
+	PGresult	*res;
+	bool		ok;
+
+	if (value)
+		*value = NULL;
+
+	if (!PQsendQuery(con, sql))
+		return false;
+
+	for (;;)
+	{
+		int		ret = PQflush(con);
+
+		if (ret == 0)
+			break;
+		if (ret < 0 ||
+			!waitForSocket(con, WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE,
+						   deadline) ||
+			!PQconsumeInput(con))
+			return false;
+	}
+
+	while (PQisBusy(con))
+	{
+		if (!waitForSocket(con, WL_SOCKET_READABLE, deadline) ||
+			!PQconsumeInput(con))
+			return false;
+	}
+
+	res = PQgetResult(con);
+	ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+
+	if (ok && value && PQntuples(res) > 0 && PQnfields(res) > 0 &&
+		!PQgetisnull(res, 0, 0))
+		*value = pstrdup(PQgetvalue(res, 0, 0));
+
+	PQclear(res);
+
+	/* Collect the end of the results, so that con can be used again */
+	while (ok && PQisBusy(con))
+	{
+		if (!waitForSocket(con, WL_SOCKET_READABLE, deadline) ||
+			!PQconsumeInput(con))
+			return false;
+	}
+	while (ok && (res = PQgetResult(con)) != NULL)
+		PQclear(res);
+
+	return ok;
+}
+
+/*
+ * Wait until the socket of con is ready for events, or deadline passes.
+ * Meanwhile keep answering the other gossip members, who would otherwise
+ * suspect us.  Returns false on timeout, postmaster death or SIGTERM.  We
+ * don't wait for our latch, so whatever set it is left to the main loop.
+ */
+static bool
+waitForSocket(PGconn *con, int events, uint64 deadline)
+{
+	for (;;)
+	{
+		uint64	now = keeperMonotonicUsec();
+		long	wait;
+		int		rc;
+
+		if (now >= deadline || got_sigterm)
+			return false;
+
+		wait = (long) ((deadline - now) / 1000) + 1;
+		if (gossipSocket() >= 0)
+			wait = Min(wait, GOSSIP_POLL_TIMEOUT);
+
+#if PG_VERSION_NUM >= 100000
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   events | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+							   PQsocket(con),
+							   wait,
+							   PG_WAIT_EXTENSION);
+#else
+		rc = WaitLatchOrSocket(&MyProc->procLatch,
+							   events | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+							   PQsocket(con),
+							   wait);
+#endif
+
+		if (rc & WL_POSTMASTER_DEATH)
+			return false;
+
+		if (gossipSocket() >= 0)
+		{
+			gossipReceive();
+			runGossip();
+		}
+
+		if (rc & events)
+			return true;
+	}
+}
+
+/* Report a mistake in the parameters, see checkParameter() */
+static bool
+parameterError(const char *message)
+{
+	ereport(LOG,
+			(errmsg("%s", message),
+			 errdetail("pg_keeper stops until the server restarts.")));
+
+	return false;
+}
+
 /* Check the mandatory parameteres */
-static void
+static bool
 checkParameter()
 {
 	if (!EnableHotStandby)
-		ereport(ERROR, (errmsg("hot_standby must be enabled.")));
+		return parameterError("hot_standby must be enabled.");
 
 	if (pgkeeper_partner_conninfo == NULL || pgkeeper_partner_conninfo[0] == '\0')
-		ereport(ERROR, (errmsg("pg_keeper.partner_conninfo must be specified.")));
+		return parameterError("pg_keeper.partner_conninfo must be specified.");
 
 	if (pgkeeper_my_conninfo == NULL || pgkeeper_my_conninfo[0] == '\0')
-		ereport(ERROR, (errmsg("pg_keeper.my_conninfo must be specified.")));
+		return parameterError("pg_keeper.my_conninfo must be specified.");
+
+	if (pgkeeper_gossip_address != NULL && pgkeeper_gossip_address[0] != '\0' &&
+		(pgkeeper_gossip_secret == NULL || pgkeeper_gossip_secret[0] == '\0'))
+		return parameterError("pg_keeper.gossip_secret must be specified to use pg_keeper.gossip_address.");
+
+	if (pgkeeper_require_witness &&
+		(pgkeeper_gossip_address == NULL || pgkeeper_gossip_address[0] == '\0'))
+		return parameterError("pg_keeper.gossip_address must be specified to use pg_keeper.require_witness.");
 
 	if (SyncRepStandbyNames != NULL && SyncRepStandbyNames[0] != '\0')
 	{
@@ -364,6 +1392,8 @@ checkParameter()
 		keeperShmem->sync_mode = true;
 		SpinLockRelease(&keeperShmem->mutex);
 	}
+
+	return true;
 }
 
 static char *
@@ -381,6 +1411,8 @@ getStatusPsString(KeeperStatus status)
 		return "(master:connected)";
 	else if (status == KEEPER_MASTER_ASYNC)
 		return "(master:async)";
+	else if (status == KEEPER_MASTER_FENCED)
+		return "(master:fenced)";
 	else
 		ereport(ERROR, (errmsg("Invalid status %d", status)));
 }
@@ -388,11 +1420,71 @@ getStatusPsString(KeeperStatus status)
 void
 updateStatus(KeeperStatus status)
 {
+	KeeperStatus old_status;
+
 	/* Update statuc in shmem */
 	SpinLockAcquire(&keeperShmem->mutex);
+	old_status = keeperShmem->current_status;
 	keeperShmem->current_status = status;
 	SpinLockRelease(&keeperShmem->mutex);
 
 	/* Then, update process title */
 	set_ps_display(getStatusPsString(status), false);
+
+	publishStatusFile();
+
+	/* Announce ourselves as soon as we accept writes */
+	if (isWritableStatus(status) && !isWritableStatus(old_status))
+		publishEndpoint();
+}
+
+/*
+ * Are we in master mode in this status?
+ */
+static bool
+isMasterStatus(KeeperStatus status)
+{
+	return status >= KEEPER_MASTER_READY;
+}
+
+/*
+ * Is the master accepting writes in this status?
+ */
+static bool
+isWritableStatus(KeeperStatus status)
+{
+	return status == KEEPER_MASTER_READY ||
+		status == KEEPER_MASTER_CONNECTED ||
+		status == KEEPER_MASTER_ASYNC;
+}
+
+/*
+ * Return microseconds from an arbitrary fixed point in the past.  Unlike
+ * wall clock time this never jumps, so it is safe for measuring intervals.
+ */
+uint64
+keeperMonotonicUsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Return the timeline we are writing WAL on, or 0 if still in recovery.
+ */
+TimeLineID
+keeperTimeLine(void)
+{
+	/* This also makes sure ThisTimeLineID is initialized */
+	if (RecoveryInProgress())
+		return 0;
+
+#if PG_VERSION_NUM >= 150000
+	return GetWALInsertionTimeLine();
+#else
+	return ThisTimeLineID;
+#endif
 }
@@ -17,9 +17,12 @@
 #include "storage/proc.h"
 #include "storage/shmem.h"
 
+#include "fmgr.h"
 #include "tcop/utility.h"
 #include "libpq-int.h"
 
+#include "gossip.h"
+
 typedef enum KeeperStatus
 {
 	KEEPER_STANDBY_READY = 0,
@@ -27,9 +30,40 @@ typedef enum KeeperStatus
 	KEEPER_STANDBY_ALONE,
 	KEEPER_MASTER_READY,
 	KEEPER_MASTER_CONNECTED,
-	KEEPER_MASTER_ASYNC
+	KEEPER_MASTER_ASYNC,
+	KEEPER_MASTER_FENCED
 } KeeperStatus;
 
+typedef enum KeeperSwitchoverState
+{
+	SWITCHOVER_NONE = 0,
+	SWITCHOVER_REQUESTED,
+	SWITCHOVER_DONE,
+	SWITCHOVER_FAILED
+} KeeperSwitchoverState;
+
+#define KEEPER_MAXCONNINFO	1024
+
+/*
+ * Client backends of the server we are connected to, other than our own
+ * connection and the backend whose pid is given for %d, if any; used to
+ * terminate them when fencing the master.  Before backend_type, tell them
+ * from background workers, which have no client address, and walsenders.
+ */
+#if PG_VERSION_NUM >= 100000
+#define SQL_CLIENT_BACKENDS \
+	"FROM pg_stat_activity WHERE backend_type = 'client backend' " \
+	"AND pid <> pg_backend_pid() AND pid <> %d"
+#else
+#define SQL_CLIENT_BACKENDS \
+	"FROM pg_stat_activity WHERE client_port IS NOT NULL " \
+	"AND pid <> pg_backend_pid() AND pid <> %d " \
+	"AND pid NOT IN (SELECT pid FROM pg_stat_replication)"
+#endif
+
+/* drain, catchup, promote and demote, see switchover.c */
+#define SWITCHOVER_NPHASES	4
+
 typedef struct KeeperNode
 {
 	char *conninfo;
@@ -38,11 +72,60 @@ typedef struct KeeperNode
 	bool is_sync;
 } KeeperNode;
 
+typedef struct KeeperStats
+{
+	uint64		heartbeats;			/* heartbeats attempted */
+	uint64		heartbeat_failures;	/* heartbeats that failed */
+	uint64		promotions;			/* promotions done by us */
+	uint64		async_changes;		/* changes to asynchronous replication */
+	int			retry_count;		/* consecutive failed heartbeats */
+
+	/* round-trip latency of successful heartbeats, in usec */
+	uint64		latency_last;
+	uint64		latency_min;
+	uint64		latency_max;
+	uint64		latency_sum;
+	uint64		latency_count;
+
+	/* WAL streaming progress, only maintained on the standby */
+	XLogRecPtr	partner_lsn;		/* primary's LSN as of last heartbeat */
+	XLogRecPtr	received_lsn;		/* WAL received from the primary */
+	uint64		walreceiver_restarts;	/* walreceivers restarted by us */
+} KeeperStats;
+
 typedef struct KeeperShmem
 {
 	KeeperStatus current_status;
 	slock_t		mutex;	/* mutex for editing data on shmem */
 	bool		sync_mode;	/* we are using synchronous replication? */
+	KeeperStats	stats;	/* counters exposed through the status file */
+
+	/* lease protocol, see renewLease() */
+	bool		fenced;				/* master: refusing writes? */
+	bool		lease_pending;		/* master: promoted, no lease granted yet */
+	uint64		lease_granted_until;	/* standby: when our leases run out */
+	bool		lease_revoked;		/* standby: refusing to grant leases? */
+
+	/* the pg_keeper worker, 0 and NULL while not running */
+	pid_t		keeper_pid;
+	Latch	   *keeper_latch;
+
+	/* planned switchover, see switchover.c */
+	KeeperSwitchoverState switchover_state;	/* master */
+	pid_t		switchover_requester;	/* master: backend waiting for it */
+	uint64		switchover_usec[SWITCHOVER_NPHASES];	/* master */
+	bool		promote_requested;	/* standby */
+
+	/* detector state kept across restarts of the worker, see KeeperMain() */
+	uint32		worker_starts;
+	uint64		lease_expiry;		/* master: when our lease runs out */
+	bool		stale_master;		/* master: partner promoted behind our back? */
+	char		master_conninfo[KEEPER_MAXCONNINFO];	/* standby: master we follow */
+
+	/* gossip membership as seen by the worker, see keeperWaitLatch() */
+	LWLock	   *members_lock;	/* protects nmembers and members */
+	int			nmembers;
+	GossipMember members[GOSSIP_MAX_MEMBERS];
 } KeeperShmem;
 
 /* pg_keeper.c */
@@ -50,22 +133,78 @@ extern void	_PG_init(void);
 extern void _PG_fini(void);
 extern void	KeeperMain(Datum);
 extern bool	heartbeatServer(const char *conninfo, int r_count);
+extern bool	heartbeatServerBefore(const char *conninfo, int r_count,
+								  uint64 deadline);
+extern bool	heartbeatServerGetLSN(const char *conninfo, int r_count,
+								  XLogRecPtr *lsn);
 extern bool execSQL(const char *conninfo, const char *sql);
+extern char *execSQLValue(const char *conninfo, const char *sql);
+extern char *execSQLValueBefore(const char *conninfo, const char *sql,
+								uint64 deadline);
+extern PGconn *connectBefore(const char *conninfo, uint64 deadline);
+extern bool execQueryBefore(PGconn *con, const char *sql, uint64 deadline,
+							char **value);
+extern int	keeperWaitLatch(long timeout);
+extern Datum pg_keeper_members(PG_FUNCTION_ARGS);
 extern char *KeeperMaster;
 extern char *KeeperStandby;
 extern KeeperShmem	*keeperShmem;
+extern MemoryContext KeeperLoopContext;
+extern bool	keeperResumed;
 sig_atomic_t got_sighup;
 sig_atomic_t got_sigterm;
 
 extern void updateStatus(KeeperStatus status);
+extern uint64 keeperMonotonicUsec(void);
+extern TimeLineID keeperTimeLine(void);
+
+/* endpoint.c */
+extern void publishEndpoint(void);
+
+/* follow.c */
+extern char *findNewMaster(void);
+extern char *currentMaster(void);
+extern bool isFollowing(const char *conninfo);
+extern void followMaster(const char *conninfo);
+extern void syncReplicationSlots(const char *conninfo);
+extern void reportUnsyncedSlots(void);
+
+/* prewarm.c */
+extern void setupPrewarm(void);
+extern void prewarmBuffers(const char *conninfo);
+
+/* rejoin.c */
+extern bool partnerIsNewerMaster(uint64 deadline);
+extern TimeLineID masterTimeLine(const char *conninfo, uint64 deadline);
+extern void startRejoin(void);
+extern char *buildPrimaryConninfo(const char *conninfo);
+extern char *buildRecoveryConf(const char *conninfo);
+extern void launchKeeperScript(const char *script, const char *arg1,
+							   const char *arg2);
+
+/* status.c */
+extern void openStatusFile(void);
+extern void publishStatusFile(void);
 
 /* master.c */
 extern bool KeeperMainMaster(void);
 extern void setupKeeperMaster(void);
+extern void fenceMaster(void);
+extern void unfenceMaster(void);
+
+/* switchover.c */
+extern bool runSwitchover(void);
+extern bool promoteRequested(void);
+extern void finishSwitchover(KeeperSwitchoverState state);
+extern void cleanupSwitchover(void);
+extern pid_t switchoverRequester(void);
+extern Datum pg_keeper_switchover(PG_FUNCTION_ARGS);
+extern Datum pg_keeper_promote(PG_FUNCTION_ARGS);
 
 /* standby.c */
 extern bool	KeeperMainStandby(void);
 extern void setupKeeperStandby(void);
+extern Datum pg_keeper_grant_lease(PG_FUNCTION_ARGS);
 
 /* GUC variables */
 extern int	pgkeeper_keepalives_time;
@@ -73,3 +212,23 @@ extern int	pgkeeper_keepalives_count;
 extern char *pgkeeper_partner_conninfo;
 extern char *pgkeeper_my_conninfo;
 extern char *pgkeeper_after_command;
+extern int	pgkeeper_stall_timeout;
+extern int	pgkeeper_lease_time;
+extern int	pgkeeper_lease_margin;
+extern bool	pgkeeper_auto_rejoin;
+extern char *pgkeeper_replication_conninfo;
+extern bool	pgkeeper_failover_candidate;
+extern char *pgkeeper_peer_conninfos;
+extern bool	pgkeeper_sync_slots;
+extern int	pgkeeper_prewarm_interval;
+extern int	pgkeeper_prewarm_blocks;
+extern int	pgkeeper_prewarm_io_budget;
+extern char *pgkeeper_gossip_address;
+extern char *pgkeeper_gossip_seeds;
+extern char *pgkeeper_gossip_secret;
+extern int	pgkeeper_restart_interval;
+extern bool	pgkeeper_require_witness;
+extern int	pgkeeper_switchover_timeout;
+extern char *pgkeeper_endpoint;
+extern char *pgkeeper_endpoint_file;
+extern char *pgkeeper_endpoint_socket;
@@ -0,0 +1,66 @@
+/* -------------------------------------------------------------------------
+ *
+ * pg_keeper_status.h
+ *
+ * Layout of the memory-mapped status file published by pg_keeper.
+ *
+ * This header deliberately depends on nothing but the C standard library
+ * so that external monitoring tools can include it as-is.  The file lives
+ * at $PGDATA/pg_keeper.status and is rewritten in place by the pg_keeper
+ * worker under a sequence lock.  A reader maps it read-only and does:
+ *
+ *	do {
+ *		s1 = st->seq;				(retry while s1 is odd)
+ *		read barrier;
+ *		copy the fields it is interested in;
+ *		read barrier;
+ *	} while (st->seq != s1);
+ *
+ * Readers must check magic and version before trusting anything else.
+ * New fields are only ever appended, with version bumped.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef PG_KEEPER_STATUS_H
+#define PG_KEEPER_STATUS_H
+
+#include <stdint.h>
+
+#define PGKEEPER_STATUS_FILENAME	"pg_keeper.status"
+#define PGKEEPER_STATUS_MAGIC		0x504b5354	/* "PKST" */
+#define PGKEEPER_STATUS_VERSION		2
+
+typedef struct PgKeeperStatusFile
+{
+	uint32_t	magic;			/* PGKEEPER_STATUS_MAGIC */
+	uint32_t	version;		/* PGKEEPER_STATUS_VERSION */
+	uint32_t	size;			/* sizeof(PgKeeperStatusFile) of the writer */
+	volatile uint32_t seq;		/* odd while an update is in progress */
+
+	int32_t		pid;			/* pid of the pg_keeper worker */
+	int32_t		status;			/* KeeperStatus, see pg_keeper.h */
+	int32_t		sync_mode;		/* 1 if synchronous replication is used */
+	int32_t		retry_count;	/* consecutive failed heartbeats */
+
+	int64_t		updated_at;		/* last update, usec since Unix epoch */
+
+	/* counters, monotonically increasing while the worker runs */
+	uint64_t	heartbeats;			/* heartbeats attempted */
+	uint64_t	heartbeat_failures;	/* heartbeats that failed */
+	uint64_t	promotions;			/* promotions done by this keeper */
+	uint64_t	async_changes;		/* changes to asynchronous replication */
+
+	/* heartbeat round-trip latency of successful heartbeats, in usec */
+	uint64_t	latency_last;
+	uint64_t	latency_min;
+	uint64_t	latency_max;
+	uint64_t	latency_sum;
+	uint64_t	latency_count;
+
+	/* added in version 2: WAL streaming progress, standby only */
+	uint64_t	partner_lsn;		/* primary's LSN as of last heartbeat */
+	uint64_t	received_lsn;		/* WAL received from the primary */
+	uint64_t	walreceiver_restarts;	/* stalled walreceivers restarted */
+} PgKeeperStatusFile;
+
+#endif							/* PG_KEEPER_STATUS_H */
@@ -0,0 +1,175 @@
+/* -------------------------------------------------------------------------
+ *
+ * pg_keeper_witness.c
+ *
+ * Standalone witness for pg_keeper.
+ *
+ * In a two-node cluster the standby alone cannot tell a failed master
+ * from a failed link to it.  The witness is a gossip member without a
+ * PostgreSQL server: it probes the master on behalf of the standby, so
+ * that with pg_keeper.require_witness the standby promotes only when the
+ * witness is reachable and can't reach the master either.
+ *
+ * The gossip secret is taken from the PGKEEPER_GOSSIP_SECRET environment
+ * variable rather than the command line, where other users could see it.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres_fe.h"
+
+#include <signal.h>
+#include <sys/select.h>
+
+#include "getopt_long.h"
+
+#include "gossip.h"
+
+static const char *progname;
+static volatile sig_atomic_t got_signal = false;
+
+static void usage(void);
+static void handle_signal(int signo);
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"address", required_argument, NULL, 'a'},
+		{"seeds", required_argument, NULL, 's'},
+		{"interval", required_argument, NULL, 'i'},
+		{"indirect-checks", required_argument, NULL, 'c'},
+		{"state-file", required_argument, NULL, 'f'},
+		{"help", no_argument, NULL, '?'},
+		{NULL, 0, NULL, 0}
+	};
+	char	   *address = NULL;
+	char	   *seeds = NULL;
+	char	   *state_file = NULL;
+	char	   *secret;
+	int			c;
+	int			optindex;
+
+	progname = get_progname(argv[0]);
+
+	if (argc > 1 &&
+		(strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0))
+	{
+		usage();
+		exit(0);
+	}
+
+	while ((c = getopt_long(argc, argv, "a:s:i:c:f:", long_options,
+							&optindex)) != -1)
+	{
+		switch (c)
+		{
+			case 'a':
+				address = pg_strdup(optarg);
+				break;
+			case 's':
+				seeds = pg_strdup(optarg);
+				break;
+			case 'i':
+				pgkeeper_gossip_interval = atoi(optarg);
+				break;
+			case 'c':
+				pgkeeper_gossip_indirect_checks = atoi(optarg);
+				break;
+			case 'f':
+				state_file = pg_strdup(optarg);
+				break;
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n",
+						progname);
+				exit(1);
+		}
+	}
+
+	if (address == NULL || optind < argc)
+	{
+		usage();
+		exit(1);
+	}
+
+	if (pgkeeper_gossip_interval < 10 || pgkeeper_gossip_indirect_checks < 0)
+	{
+		fprintf(stderr, "%s: invalid interval or number of indirect checks\n",
+				progname);
+		exit(1);
+	}
+
+	secret = getenv("PGKEEPER_GOSSIP_SECRET");
+	if (secret == NULL || secret[0] == '\0')
+	{
+		fprintf(stderr, "%s: PGKEEPER_GOSSIP_SECRET must be set to pg_keeper.gossip_secret of the servers\n",
+				progname);
+		exit(1);
+	}
+
+	if (!gossipInit(address, seeds, secret, state_file))
+		exit(1);
+
+	pqsignal(SIGINT, handle_signal);
+	pqsignal(SIGTERM, handle_signal);
+
+	gossipSetSelf(GOSSIP_ROLE_WITNESS, 0);
+
+	fprintf(stderr, "%s: started on \"%s\"\n", progname, address);
+
+	while (!got_signal)
+	{
+		fd_set		rfds;
+		struct timeval tv;
+		long		timeout = gossipTimeout();
+		int			sock = gossipSocket();
+
+		FD_ZERO(&rfds);
+		FD_SET(sock, &rfds);
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+
+		if (select(sock + 1, &rfds, NULL, NULL, &tv) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: select() failed: %s\n", progname,
+					strerror(errno));
+			exit(1);
+		}
+
+		if (FD_ISSET(sock, &rfds))
+			gossipReceive();
+		gossipRun();
+	}
+
+	fprintf(stderr, "%s: terminated\n", progname);
+
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("%s is a witness member for pg_keeper gossip membership.\n\n",
+		   progname);
+	printf("Usage:\n");
+	printf("  %s -a HOST:PORT [OPTION]...\n\n", progname);
+	printf("Options:\n");
+	printf("  -a, --address=HOST:PORT     address to gossip on\n");
+	printf("  -s, --seeds=HOST:PORT,...   members to join the cluster through\n");
+	printf("  -i, --interval=MS           protocol period, same as pg_keeper.gossip_interval (default: %d)\n",
+		   pgkeeper_gossip_interval);
+	printf("  -c, --indirect-checks=NUM   same as pg_keeper.gossip_indirect_checks (default: %d)\n",
+		   pgkeeper_gossip_indirect_checks);
+	printf("  -f, --state-file=FILE       file to keep the incarnation in across restarts\n");
+	printf("  -?, --help                  show this help, then exit\n");
+	printf("\nThe environment variable PGKEEPER_GOSSIP_SECRET must be set to the\n");
+	printf("gossip secret of the cluster, see pg_keeper.gossip_secret.\n");
+}
+
+static void
+handle_signal(int signo)
+{
+	got_signal = true;
+}
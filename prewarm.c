@@ -0,0 +1,278 @@
+/* -------------------------------------------------------------------------
+ *
+ * prewarm.c
+ *
+ * Buffer cache pre-warming for pg_keeper standby mode.
+ *
+ * After promotion the new master starts with a buffer cache shaped by WAL
+ * replay rather than by the read workload.  To avoid that, the standby
+ * periodically fetches the list of hot blocks from the master's
+ * pg_buffercache view and reads them into its own shared buffers, a
+ * limited number of blocks per heartbeat interval.  Since physical
+ * replication keeps relfilenodes identical on both servers, the blocks can
+ * be read without any catalog access.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "pg_keeper.h"
+
+#include "access/xact.h"
+#include "storage/bufmgr.h"
+#include "storage/smgr.h"
+#include "utils/memutils.h"
+
+#include "libpq-int.h"
+
+#define SQL_HOT_BLOCKS \
+	"SELECT reltablespace, reldatabase, relfilenode, relforknumber, relblocknumber " \
+	"FROM pg_buffercache " \
+	"WHERE relfilenode IS NOT NULL AND usagecount >= 2 " \
+	"ORDER BY usagecount DESC LIMIT %d"
+
+typedef struct PrewarmBlock
+{
+	Oid			spcnode;
+	Oid			dbnode;
+	Oid			relnode;
+	ForkNumber	forknum;
+	BlockNumber	blocknum;
+} PrewarmBlock;
+
+void	setupPrewarm(void);
+void	prewarmBuffers(const char *conninfo);
+
+static void fetchHotBlocks(const char *conninfo);
+static int	comparePrewarmBlock(const void *a, const void *b);
+
+/* GUC variables */
+int		pgkeeper_prewarm_interval;
+int		pgkeeper_prewarm_blocks;
+int		pgkeeper_prewarm_io_budget;
+
+/* Blocks to load, sorted so that we read them in physical order */
+static PrewarmBlock *blocks = NULL;
+static int	nblocks = 0;
+static int	next_block = 0;
+
+/* When to refresh the list of hot blocks from the master */
+static uint64 next_fetch_time;
+
+/*
+ * Set up pre-warming state for standby mode.
+ */
+void
+setupPrewarm(void)
+{
+	if (blocks)
+		pfree(blocks);
+
+	blocks = NULL;
+	nblocks = 0;
+	next_block = 0;
+	next_fetch_time = keeperMonotonicUsec();
+}
+
+/*
+ * Called once per heartbeat interval in standby mode.  Refresh the list
+ * of hot blocks from the master at conninfo if it's time to do so, then
+ * read up to pgkeeper_prewarm_io_budget of them into shared buffers.
+ */
+void
+prewarmBuffers(const char *conninfo)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	RelFileNode	rnode;
+	ForkNumber	forknum = InvalidForkNumber;
+	BlockNumber	rel_nblocks = InvalidBlockNumber;
+	int			nread = 0;
+	bool		failed = false;
+
+	if (pgkeeper_prewarm_interval == 0)
+		return;
+
+	if (keeperMonotonicUsec() >= next_fetch_time)
+	{
+		fetchHotBlocks(conninfo);
+		next_fetch_time = keeperMonotonicUsec() +
+			(uint64) pgkeeper_prewarm_interval * 1000000;
+	}
+
+	if (next_block >= nblocks)
+		return;
+
+	/* Buffer pins need a resource owner, so do it in a transaction */
+	StartTransactionCommand();
+
+	rnode.spcNode = InvalidOid;
+	rnode.dbNode = InvalidOid;
+	rnode.relNode = InvalidOid;
+
+	/*
+	 * Replay may truncate or drop a relation after we looked up its size,
+	 * and reading a block that is gone raises an error.  Pre-warming is
+	 * only an optimization, so that must not interrupt the failure
+	 * detection: report it and go on with the next block next time.
+	 */
+	PG_TRY();
+	{
+		while (next_block < nblocks && nread < pgkeeper_prewarm_io_budget)
+		{
+			PrewarmBlock *blk = &blocks[next_block++];
+			Buffer		buf;
+
+			/* Look up the relation size only when moving to a new fork */
+			if (blk->spcnode != rnode.spcNode || blk->dbnode != rnode.dbNode ||
+				blk->relnode != rnode.relNode || blk->forknum != forknum)
+			{
+				SMgrRelation reln;
+
+				rnode.spcNode = blk->spcnode;
+				rnode.dbNode = blk->dbnode;
+				rnode.relNode = blk->relnode;
+				forknum = blk->forknum;
+
+				reln = smgropen(rnode, InvalidBackendId);
+				if (smgrexists(reln, forknum))
+					rel_nblocks = smgrnblocks(reln, forknum);
+				else
+					rel_nblocks = 0;
+			}
+
+			/* The relation might not have been replayed up to here yet */
+			if (blk->blocknum >= rel_nblocks)
+				continue;
+
+#if PG_VERSION_NUM >= 150000
+			buf = ReadBufferWithoutRelcache(rnode, forknum, blk->blocknum,
+											RBM_NORMAL, NULL, true);
+#else
+			buf = ReadBufferWithoutRelcache(rnode, forknum, blk->blocknum,
+											RBM_NORMAL, NULL);
+#endif
+			ReleaseBuffer(buf);
+			nread++;
+		}
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		/* This releases the buffer pin as well */
+		AbortCurrentTransaction();
+		MemoryContextSwitchTo(oldcontext);
+
+		ereport(LOG,
+				(errmsg("pg_keeper could not pre-warm block %u of relation %u/%u/%u: %s",
+						blocks[next_block - 1].blocknum,
+						blocks[next_block - 1].spcnode,
+						blocks[next_block - 1].dbnode,
+						blocks[next_block - 1].relnode,
+						edata->message)));
+		FreeErrorData(edata);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		return;
+
+	CommitTransactionCommand();
+	MemoryContextSwitchTo(oldcontext);
+
+	if (next_block >= nblocks)
+		ereport(DEBUG1,
+				(errmsg("pg_keeper finished pre-warming %d blocks", nblocks)));
+}
+
+/*
+ * Fetch the list of hot blocks from the master's pg_buffercache view.
+ * On failure we keep working on the list we already have.
+ */
+static void
+fetchHotBlocks(const char *conninfo)
+{
+	PGconn		*con;
+	PGresult	*res;
+	char		sql[256];
+	int			ntuples;
+	int			i;
+
+	con = PQconnectdb(conninfo);
+	if (PQstatus(con) != CONNECTION_OK)
+	{
+		PQfinish(con);
+		return;
+	}
+
+	snprintf(sql, sizeof(sql), SQL_HOT_BLOCKS, pgkeeper_prewarm_blocks);
+	res = PQexec(con, sql);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		ereport(LOG,
+				(errmsg("could not get hot blocks from server : \"%s\"",
+						conninfo),
+				 errdetail("%s", PQerrorMessage(con)),
+				 errhint("pg_buffercache must be installed on the master server.")));
+		PQclear(res);
+		PQfinish(con);
+		return;
+	}
+
+	ntuples = PQntuples(res);
+
+	if (blocks)
+		pfree(blocks);
+	blocks = (PrewarmBlock *)
+		MemoryContextAlloc(TopMemoryContext,
+						   sizeof(PrewarmBlock) * Max(ntuples, 1));
+
+	for (i = 0; i < ntuples; i++)
+	{
+		blocks[i].spcnode = (Oid) strtoul(PQgetvalue(res, i, 0), NULL, 10);
+		blocks[i].dbnode = (Oid) strtoul(PQgetvalue(res, i, 1), NULL, 10);
+		blocks[i].relnode = (Oid) strtoul(PQgetvalue(res, i, 2), NULL, 10);
+		blocks[i].forknum = (ForkNumber) atoi(PQgetvalue(res, i, 3));
+		blocks[i].blocknum = (BlockNumber) strtoul(PQgetvalue(res, i, 4), NULL, 10);
+	}
+
+	PQclear(res);
+	PQfinish(con);
+
+	qsort(blocks, ntuples, sizeof(PrewarmBlock), comparePrewarmBlock);
+	nblocks = ntuples;
+	next_block = 0;
+
+	ereport(DEBUG1,
+			(errmsg("pg_keeper fetched %d hot blocks from master server", nblocks)));
+}
+
+/*
+ * Sort blocks by relation, fork and block number so that each relation
+ * is read sequentially.
+ */
+static int
+comparePrewarmBlock(const void *a, const void *b)
+{
+	const PrewarmBlock *x = (const PrewarmBlock *) a;
+	const PrewarmBlock *y = (const PrewarmBlock *) b;
+
+	if (x->spcnode != y->spcnode)
+		return x->spcnode < y->spcnode ? -1 : 1;
+	if (x->dbnode != y->dbnode)
+		return x->dbnode < y->dbnode ? -1 : 1;
+	if (x->relnode != y->relnode)
+		return x->relnode < y->relnode ? -1 : 1;
+	if (x->forknum != y->forknum)
+		return x->forknum < y->forknum ? -1 : 1;
+	if (x->blocknum != y->blocknum)
+		return x->blocknum < y->blocknum ? -1 : 1;
+	return 0;
+}
@@ -0,0 +1,299 @@
+/* -------------------------------------------------------------------------
+ *
+ * rejoin.c
+ *
+ * Rejoin of a stale master as a standby for pg_keeper.
+ *
+ * When a failed master comes back after its standby has been promoted, we
+ * would otherwise end up with two masters.  pg_keeper detects that the
+ * partner is a master on a newer timeline and, if enabled, stops the
+ * server, resynchronizes it with pg_rewind, which only copies the blocks
+ * that diverged, and starts it again as a standby of the new master.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pg_keeper.h"
+
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+
+#define SCRIPT_LOG_FILENAME		"pg_keeper_script.log"
+
+/*
+ * Returns 0 if the server is in recovery, otherwise its current timeline,
+ * taken from the name of the WAL segment being written.
+ */
+#if PG_VERSION_NUM >= 100000
+#define SQL_GET_MASTER_TIMELINE \
+	"SELECT CASE WHEN pg_is_in_recovery() THEN 0 " \
+	"ELSE ('x' || substr(pg_walfile_name(pg_current_wal_lsn()), 1, 8))::bit(32)::int END"
+#else
+#define SQL_GET_MASTER_TIMELINE \
+	"SELECT CASE WHEN pg_is_in_recovery() THEN 0 " \
+	"ELSE ('x' || substr(pg_xlogfile_name(pg_current_xlog_location()), 1, 8))::bit(32)::int END"
+#endif
+
+/*
+ * Stop the server, rewind it to the new master and start it as a standby.
+ * Arguments are the bin directory, the data directory, the connection
+ * string for pg_rewind, and the recovery settings to write.  See
+ * launchKeeperScript().
+ */
+#if PG_VERSION_NUM >= 120000
+#define REJOIN_SCRIPT \
+	"\"$1/pg_ctl\" stop -D \"$2\" -m fast -w && " \
+	"\"$1/pg_rewind\" -D \"$2\" --source-server=\"$3\" && " \
+	"touch \"$2/standby.signal\" && " \
+	"printf '%s\\n' \"$4\" >> \"$2/postgresql.auto.conf\" && " \
+	"\"$1/pg_ctl\" start -D \"$2\" -w"
+#else
+#define REJOIN_SCRIPT \
+	"\"$1/pg_ctl\" stop -D \"$2\" -m fast -w && " \
+	"\"$1/pg_rewind\" -D \"$2\" --source-server=\"$3\" && " \
+	"printf '%s\\n' \"$4\" > \"$2/recovery.conf\" && " \
+	"\"$1/pg_ctl\" start -D \"$2\" -w"
+#endif
+
+bool	partnerIsNewerMaster(uint64 deadline);
+TimeLineID	masterTimeLine(const char *conninfo, uint64 deadline);
+void	startRejoin(void);
+
+char	*buildPrimaryConninfo(const char *conninfo);
+char	*buildRecoveryConf(const char *conninfo);
+void	launchKeeperScript(const char *script, const char *arg1, const char *arg2);
+
+static void appendConninfoValue(StringInfo buf, const char *value);
+static void appendConfValue(StringInfo buf, const char *value);
+
+/* GUC variables */
+bool	pgkeeper_auto_rejoin;
+char	*pgkeeper_replication_conninfo;
+
+/*
+ * Check whether the partner server is a master running on a newer timeline
+ * than ours, which means it has been promoted while we were away and our
+ * data may have diverged from it.  A partner that doesn't answer before
+ * deadline is not.
+ */
+bool
+partnerIsNewerMaster(uint64 deadline)
+{
+	TimeLineID	partner_tli;
+	TimeLineID	my_tli;
+
+	partner_tli = masterTimeLine(pgkeeper_partner_conninfo, deadline);
+	my_tli = keeperTimeLine();
+
+	/* The partner is a standby, or we don't know our own timeline yet */
+	if (partner_tli == 0 || my_tli == 0)
+		return false;
+
+	if (partner_tli <= my_tli)
+		return false;
+
+	ereport(LOG,
+			(errmsg("pg_keeper found the partner server running as master on timeline %u, newer than ours %u",
+					partner_tli, my_tli)));
+
+	return true;
+}
+
+/*
+ * Return the timeline of the server at conninfo if it is a master, or 0 if
+ * it is in recovery or could not be reached before deadline.
+ */
+TimeLineID
+masterTimeLine(const char *conninfo, uint64 deadline)
+{
+	char	   *value;
+
+	if ((value = execSQLValueBefore(conninfo, SQL_GET_MASTER_TIMELINE,
+									deadline)) == NULL)
+		return 0;
+
+	return (TimeLineID) strtoul(value, NULL, 10);
+}
+
+/*
+ * Launch the rejoin script in the background.
+ */
+void
+startRejoin(void)
+{
+	char	   *conf = buildRecoveryConf(pgkeeper_partner_conninfo);
+
+	ereport(LOG,
+			(errmsg("pg_keeper starts to rejoin as a standby of the partner server")));
+
+	launchKeeperScript(REJOIN_SCRIPT, pgkeeper_partner_conninfo, conf);
+
+	pfree(conf);
+}
+
+/*
+ * Build primary_conninfo to follow the master reachable through conninfo.
+ * With pg_keeper.replication_conninfo set, it is used with the host and
+ * port of conninfo appended, which override its own since the last
+ * occurrence of a keyword wins.  Otherwise conninfo is used as is.
+ */
+char *
+buildPrimaryConninfo(const char *conninfo)
+{
+	StringInfoData primary;
+	PQconninfoOption *options;
+	PQconninfoOption *option;
+
+	if (pgkeeper_replication_conninfo == NULL ||
+		pgkeeper_replication_conninfo[0] == '\0')
+		return pstrdup(conninfo);
+
+	initStringInfo(&primary);
+	appendStringInfoString(&primary, pgkeeper_replication_conninfo);
+
+	if ((options = PQconninfoParse(conninfo, NULL)) != NULL)
+	{
+		for (option = options; option->keyword != NULL; option++)
+		{
+			if (option->val == NULL || option->val[0] == '\0')
+				continue;
+			if (strcmp(option->keyword, "host") != 0 &&
+				strcmp(option->keyword, "hostaddr") != 0 &&
+				strcmp(option->keyword, "port") != 0)
+				continue;
+
+			appendStringInfo(&primary, " %s=", option->keyword);
+			appendConninfoValue(&primary, option->val);
+		}
+		PQconninfoFree(options);
+	}
+
+	return primary.data;
+}
+
+/*
+ * Build the recovery settings to follow the master reachable through
+ * conninfo.
+ */
+char *
+buildRecoveryConf(const char *conninfo)
+{
+	StringInfoData conf;
+	char	   *primary = buildPrimaryConninfo(conninfo);
+
+	initStringInfo(&conf);
+#if PG_VERSION_NUM < 120000
+	appendStringInfoString(&conf, "standby_mode = 'on'\n");
+#endif
+	appendStringInfoString(&conf, "recovery_target_timeline = 'latest'\n");
+	appendStringInfoString(&conf, "primary_conninfo = ");
+	appendConfValue(&conf, primary);
+
+	pfree(primary);
+
+	return conf.data;
+}
+
+/*
+ * Launch a shell script in the background, with the bin directory and
+ * the data directory as $1 and $2, and the given arguments as $3 and $4.
+ *
+ * The script outlives this server, so it runs in its own session to escape
+ * the signals postmaster sends to our process group during shutdown. Its
+ * output goes next to the data directory, since pg_rewind would remove a
+ * file inside it.
+ */
+void
+launchKeeperScript(const char *script, const char *arg1, const char *arg2)
+{
+	char		bindir[MAXPGPATH];
+	char		logpath[MAXPGPATH];
+	pid_t		pid;
+
+	strlcpy(bindir, my_exec_path, MAXPGPATH);
+	get_parent_directory(bindir);
+
+	strlcpy(logpath, DataDir, MAXPGPATH);
+	get_parent_directory(logpath);
+	join_path_components(logpath, logpath, SCRIPT_LOG_FILENAME);
+
+	ereport(LOG,
+			(errmsg("pg_keeper launched a script, see \"%s\"", logpath)));
+
+	if ((pid = fork()) < 0)
+		ereport(ERROR,
+				(errmsg("could not fork process for script: %m")));
+
+	if (pid == 0)
+	{
+		int		fd;
+
+		setsid();
+
+		/* Don't inherit the ignored SIGPIPE etc. from the bgworker */
+		pqsignal(SIGPIPE, SIG_DFL);
+		pqsignal(SIGCHLD, SIG_DFL);
+
+		if ((fd = open("/dev/null", O_RDONLY)) >= 0)
+		{
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+		if ((fd = open(logpath, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR)) >= 0)
+		{
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+
+		execl("/bin/sh", "sh", "-c", script, "pg_keeper_script",
+			  bindir, DataDir, arg1 ? arg1 : "", arg2 ? arg2 : "",
+			  (char *) NULL);
+		_exit(1);
+	}
+}
+
+/*
+ * Append value in single quotes, escaped the way libpq expects in a
+ * connection string.
+ */
+static void
+appendConninfoValue(StringInfo buf, const char *value)
+{
+	const char *p;
+
+	appendStringInfoChar(buf, '\'');
+	for (p = value; *p; p++)
+	{
+		if (*p == '\'' || *p == '\\')
+			appendStringInfoChar(buf, '\\');
+		appendStringInfoChar(buf, *p);
+	}
+	appendStringInfoChar(buf, '\'');
+}
+
+/*
+ * Append value in single quotes, escaped the way the configuration file
+ * parser expects.
+ */
+static void
+appendConfValue(StringInfo buf, const char *value)
+{
+	const char *p;
+
+	appendStringInfoChar(buf, '\'');
+	for (p = value; *p; p++)
+	{
+		if (*p == '\'' || *p == '\\')
+			appendStringInfoChar(buf, *p);
+		appendStringInfoChar(buf, *p);
+	}
+	appendStringInfoChar(buf, '\'');
+}
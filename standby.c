@@ -15,17 +15,20 @@
 #include "access/xlog.h"
 #include "miscadmin.h"
 #include "postmaster/bgworker.h"
+#include "replication/walreceiver.h"
 #include "storage/ipc.h"
 #include "storage/latch.h"
 #include "storage/lwlock.h"
 #include "storage/proc.h"
 #include "storage/shmem.h"
+#include "storage/spin.h"
 
 #include "pgstat.h"
 
 /* these headers are used by this particular worker's code */
 #include "tcop/utility.h"
 #include "libpq-int.h"
+#include "utils/memutils.h"
 #include "utils/ps_status.h"
 
 #define	HEARTBEAT_SQL "select 1;"
@@ -35,23 +38,91 @@ void	setupKeeperStandby(void);
 
 static void doPromote(void);
 static void doAfterCommand(void);
+static void checkWalStreaming(XLogRecPtr partner_lsn);
+static void restartWalReceiver(void);
+static bool waitForLeaseExpiry(void);
+
+PG_FUNCTION_INFO_V1(pg_keeper_grant_lease);
 
 /* GUC variables */
 char	*pgkeeper_after_command;
+int		pgkeeper_stall_timeout;
+int		pgkeeper_lease_time;
+int		pgkeeper_lease_margin;
+bool	pgkeeper_require_witness;
 
 /* Variables for heartbeat */
 static int retry_count;
+static char *master_conninfo = NULL;	/* master we are following */
+
+/* Variables for WAL streaming stall detection */
+static XLogRecPtr last_received_lsn;
+static uint64 last_progress_time;
 
 /*
- * Set up several parameters for standby mode.
+ * Set up several parameters for standby mode. When resuming, carry on
+ * with the state left in shared memory.
  */
 void
 setupKeeperStandby()
 {
 	PGconn *con;
 
-	/* Set up variables */
-	retry_count = 0;
+	/* We come here again after every error, drop the copy we made then */
+	if (master_conninfo)
+	{
+		pfree(master_conninfo);
+		master_conninfo = NULL;
+	}
+
+	if (keeperResumed)
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper resumes standby mode")));
+
+		retry_count = keeperShmem->stats.retry_count;
+		master_conninfo = MemoryContextStrdup(TopMemoryContext,
+											  keeperShmem->master_conninfo);
+
+		/*
+		 * We may have stopped granting leases just before the error.  Grant
+		 * them again unless a switchover has asked us to promote.
+		 */
+		SpinLockAcquire(&keeperShmem->mutex);
+		keeperShmem->lease_revoked = keeperShmem->promote_requested;
+		SpinLockRelease(&keeperShmem->mutex);
+	}
+	else
+	{
+		char	   *current = currentMaster();
+
+		/*
+		 * Set up variables. We may have followed a new master before the
+		 * server restarted, in which case keep watching that one.
+		 */
+		retry_count = 0;
+		master_conninfo = MemoryContextStrdup(TopMemoryContext,
+											  current ? current : pgkeeper_partner_conninfo);
+		if (current)
+			pfree(current);
+
+		/*
+		 * We don't know whether we granted a lease to the master just
+		 * before we restarted, so assume we did, for as long as we
+		 * would grant one ourselves.
+		 */
+		SpinLockAcquire(&keeperShmem->mutex);
+		keeperShmem->lease_granted_until = keeperMonotonicUsec() +
+			(uint64) pgkeeper_lease_time * 1000;
+		keeperShmem->lease_revoked = keeperShmem->promote_requested;
+		strlcpy(keeperShmem->master_conninfo, master_conninfo,
+				KEEPER_MAXCONNINFO);
+		SpinLockRelease(&keeperShmem->mutex);
+	}
+
+	last_received_lsn = InvalidXLogRecPtr;
+	last_progress_time = keeperMonotonicUsec();
+	setupPrewarm();
 
 	/* Connection confirm */
 	if(!(con = PQconnectdb(pgkeeper_partner_conninfo)))
@@ -82,29 +153,26 @@ KeeperMainStandby(void)
 	while (!got_sigterm)
 	{
 		int		rc;
+		XLogRecPtr	partner_lsn;
 
 		/*
 		 * Background workers mustn't call usleep() or any direct equivalent:
 		 * instead, they may wait on their process latch, which sleeps as
 		 * necessary, but is awakened if postmaster dies.  That way the
 		 * background process goes away immediately in an emergency.
+		 * keeperWaitLatch() also keeps the gossip membership going.
 		 */
-#if PG_VERSION_NUM >= 100000
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pgkeeper_keepalives_time * 1000L,
-					   PG_WAIT_EXTENSION);
-#else
-		rc = WaitLatch(&MyProc->procLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
-					   pgkeeper_keepalives_time * 1000L);
-#endif
+		rc = keeperWaitLatch(pgkeeper_keepalives_time * 1000L);
 		ResetLatch(&MyProc->procLatch);
 
 		/* Emergency bailout if postmaster has died */
 		if (rc & WL_POSTMASTER_DEATH)
 			return false;
 
+		/* Forget whatever the previous iteration allocated */
+		MemoryContextSwitchTo(KeeperLoopContext);
+		MemoryContextReset(KeeperLoopContext);
+
 		/* If got SIGHUP, reload the configuration file */
 		if (got_sighup)
 		{
@@ -112,14 +180,47 @@ KeeperMainStandby(void)
 			ProcessConfigFile(PGC_SIGHUP);
 		}
 
+		/*
+		 * A switchover on the master has drained its writes and waited
+		 * for us to catch up, so there is nothing to wait for.
+		 */
+		if (promoteRequested())
+		{
+			ereport(LOG,
+					(errmsg("pg_keeper promotes the standby server for switchover")));
+
+			/*
+			 * The master has fenced itself and hands over on its own, so
+			 * unlike after a failover it must not be shot down.
+			 */
+			doPromote();
+
+			MemoryContextSwitchTo(TopMemoryContext);
+
+			return true;
+		}
+
 		/*
 		 * Pooling to master server. If heartbeat is failed,
-		 * increment retry_count.
+		 * increment retry_count. Otherwise make sure that the
+		 * WAL streaming from it keeps up.
 		 */
-		if (!heartbeatServer(pgkeeper_partner_conninfo, retry_count))
+		if (!heartbeatServerGetLSN(master_conninfo, retry_count,
+								   &partner_lsn))
 			retry_count++;
 		else
+		{
 			retry_count = 0; /* reset count */
+			checkWalStreaming(partner_lsn);
+			syncReplicationSlots(master_conninfo);
+
+			/*
+			 * Keep the master's working set resident here as well. Not
+			 * while the master is unreachable, since that would delay
+			 * the failure detection by another connection attempt.
+			 */
+			prewarmBuffers(master_conninfo);
+		}
 
 		/*
 		 * If retry_count is reached to keeper_keepalives_count,
@@ -127,19 +228,247 @@ KeeperMainStandby(void)
 		 */
 		if (retry_count >= pgkeeper_keepalives_count)
 		{
+			/*
+			 * Unless we are the failover candidate, wait for another
+			 * standby to be promoted and follow it.
+			 */
+			if (!pgkeeper_failover_candidate)
+			{
+				char	*new_master = findNewMaster();
+
+				if (new_master != NULL)
+				{
+					/*
+					 * Before PostgreSQL 12 we only learn that we already
+					 * follow it once the walreceiver has connected, and
+					 * restarting again wouldn't help.
+					 */
+					if (!isFollowing(new_master))
+						followMaster(new_master);
+
+					pfree(master_conninfo);
+					master_conninfo = MemoryContextStrdup(TopMemoryContext,
+														  new_master);
+					SpinLockAcquire(&keeperShmem->mutex);
+					strlcpy(keeperShmem->master_conninfo, master_conninfo,
+							KEEPER_MAXCONNINFO);
+					SpinLockRelease(&keeperShmem->mutex);
+					retry_count = 0;
+				}
+
+				continue;
+			}
+
+			/*
+			 * Other members may still reach the master, in which case
+			 * it's our link to it that failed, not the master.
+			 */
+			if (gossipRoleIsAlive(GOSSIP_ROLE_MASTER))
+			{
+				ereport(LOG,
+						(errmsg("pg_keeper does not promote, gossip members still see a master server alive")));
+				continue;
+			}
+
+			/*
+			 * Without a witness to confirm, we may as well be the one
+			 * that is cut off from the cluster.
+			 */
+			if (pgkeeper_require_witness &&
+				!gossipRoleIsAlive(GOSSIP_ROLE_WITNESS))
+			{
+				ereport(LOG,
+						(errmsg("pg_keeper does not promote, no witness is reachable")));
+				continue;
+			}
+
+			/*
+			 * The witness can only have lost the master if the master
+			 * gossips too.  Otherwise no member ever sees it alive, and
+			 * we would promote whenever our own link to it fails.
+			 */
+			if (pgkeeper_require_witness &&
+				!gossipRoleWasSeen(GOSSIP_ROLE_MASTER))
+			{
+				ereport(LOG,
+						(errmsg("pg_keeper does not promote, the master server has never been seen in gossip"),
+						 errhint("Set pg_keeper.gossip_address on the master server too.")));
+				continue;
+			}
+
+			/* The master may still be writing until its lease expires */
+			if (pgkeeper_lease_time > 0 && !waitForLeaseExpiry())
+				break;
+
 			doPromote();
 
 			/* If after command is given, execute it */
 			if (pgkeeper_after_command)
 				doAfterCommand();
 
+			MemoryContextSwitchTo(TopMemoryContext);
+
 			return true;
 		}
 	}
 
+	MemoryContextSwitchTo(TopMemoryContext);
+
 	return false;
 }
 
+/*
+ * Check whether the walreceiver is still making progress, given the
+ * master's current WAL position learned by the heartbeat.  If nothing
+ * has been received for pgkeeper_stall_timeout seconds while the master
+ * is ahead of us, the replication connection is most likely stuck (e.g.
+ * half-open socket or hung walsender), so force a reconnection.  This
+ * keeps the replay lag, and therefore the time to promote, bounded.
+ */
+static void
+checkWalStreaming(XLogRecPtr partner_lsn)
+{
+	XLogRecPtr	received_lsn;
+	XLogRecPtr	chunk_start;
+	TimeLineID	tli;
+	uint64		now = keeperMonotonicUsec();
+
+#if PG_VERSION_NUM >= 130000
+	received_lsn = GetWalRcvFlushRecPtr(&chunk_start, &tli);
+#else
+	received_lsn = GetWalRcvWriteRecPtr(&chunk_start, &tli);
+#endif
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->stats.partner_lsn = partner_lsn;
+	keeperShmem->stats.received_lsn = received_lsn;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	if (pgkeeper_stall_timeout == 0 || XLogRecPtrIsInvalid(partner_lsn))
+		return;
+
+	/* Still receiving, or nothing to receive */
+	if (received_lsn != last_received_lsn || received_lsn >= partner_lsn)
+	{
+		last_received_lsn = received_lsn;
+		last_progress_time = now;
+		return;
+	}
+
+	if (now - last_progress_time < (uint64) pgkeeper_stall_timeout * 1000000)
+		return;
+
+	ereport(LOG,
+			(errmsg("pg_keeper detected WAL streaming stall for %d seconds: received up to %X/%X, primary is at %X/%X",
+					pgkeeper_stall_timeout,
+					(uint32) (received_lsn >> 32), (uint32) received_lsn,
+					(uint32) (partner_lsn >> 32), (uint32) partner_lsn)));
+
+	restartWalReceiver();
+
+	/* Give the new walreceiver a full window to catch up */
+	last_progress_time = now;
+}
+
+/*
+ * Terminate the walreceiver. The startup process launches a new one
+ * that connects to the master from scratch.
+ */
+static void
+restartWalReceiver(void)
+{
+	pid_t	pid;
+
+	SpinLockAcquire(&WalRcv->mutex);
+	pid = WalRcv->pid;
+	SpinLockRelease(&WalRcv->mutex);
+
+	if (pid == 0)
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper found no walreceiver to restart")));
+		return;
+	}
+
+	if (kill(pid, SIGTERM) != 0)
+	{
+		ereport(LOG,
+				(errmsg("failed to send SIGTERM signal to walreceiver process : %d",
+						pid)));
+		return;
+	}
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->stats.walreceiver_restarts++;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	ereport(LOG,
+			(errmsg("pg_keeper restarted walreceiver process : %d", pid)));
+}
+
+/*
+ * Stop granting leases to the master, then wait until the leases we
+ * granted have expired plus a safety margin. By then the master has fenced
+ * itself. Returns false if we were asked to terminate meanwhile.
+ */
+static bool
+waitForLeaseExpiry(void)
+{
+	uint64	deadline;
+	uint64	now;
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->lease_revoked = true;
+	deadline = keeperShmem->lease_granted_until +
+		(uint64) pgkeeper_lease_margin * 1000;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	ereport(LOG,
+			(errmsg("pg_keeper waits for the lease of the master server to expire")));
+
+	while ((now = keeperMonotonicUsec()) < deadline)
+	{
+		int		rc;
+
+		rc = keeperWaitLatch((long) ((deadline - now) / 1000) + 1);
+		ResetLatch(&MyProc->procLatch);
+
+		if (rc & WL_POSTMASTER_DEATH || got_sigterm)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Grant a lease of the given length in milliseconds to the master, called
+ * by the master's pg_keeper through SQL.  The master's pg_keeper.lease_time
+ * is what counts, since that is how long it goes on accepting writes, so
+ * we remember the latest expiry of all the leases we granted.  We refuse
+ * once we have decided to promote ourselves.
+ */
+Datum
+pg_keeper_grant_lease(PG_FUNCTION_ARGS)
+{
+	int32	ms = PG_GETARG_INT32(0);
+	uint64	until;
+	bool	granted;
+
+	/* Only a standby can grant a lease */
+	if (!RecoveryInProgress() || ms <= 0)
+		PG_RETURN_BOOL(false);
+
+	until = keeperMonotonicUsec() + (uint64) ms * 1000;
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	granted = !keeperShmem->lease_revoked;
+	if (granted && until > keeperShmem->lease_granted_until)
+		keeperShmem->lease_granted_until = until;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	PG_RETURN_BOOL(granted);
+}
+
 /*
  * Promote standby server using ordinally way which is used by
  * pg_ctl client tool. Put trigger file into $PGDATA, and send
@@ -151,6 +480,8 @@ doPromote(void)
 	char trigger_filepath[MAXPGPATH];
 	FILE *fp;
 
+	reportUnsyncedSlots();
+
 	/* Create promote file newly */
 	snprintf(trigger_filepath, 1000, "%s/promote", DataDir);
 	if ((fp = fopen(trigger_filepath, "w")) == NULL)
@@ -166,6 +497,11 @@ doPromote(void)
 		ereport(ERROR,
 				(errmsg("failed to send SIGUSR1 signal to postmaster process : %d",
 						PostmasterPid)));
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->stats.promotions++;
+	SpinLockRelease(&keeperShmem->mutex);
+
 	ereport(LOG,
 			(errmsg("pg_keeper promoted standby server to primary server")));
 }
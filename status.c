@@ -0,0 +1,145 @@
+/* -------------------------------------------------------------------------
+ *
+ * status.c
+ *
+ * Memory-mapped status file for pg_keeper.
+ *
+ * The status, counters and heartbeat latency summary kept in shared memory
+ * are mirrored into $PGDATA/pg_keeper.status so that they can be read by
+ * external monitors without consuming a backend slot, which matters most
+ * when the server is overloaded or out of connections.  See
+ * pg_keeper_status.h for the layout and the reading protocol.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "pg_keeper.h"
+#include "pg_keeper_status.h"
+
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
+
+void	openStatusFile(void);
+void	publishStatusFile(void);
+
+/* Mapping of the status file, NULL if not available */
+static PgKeeperStatusFile *statusFile = NULL;
+
+/*
+ * Create (or reuse) the status file and map it into our address space.
+ * Failing to do so is not fatal for pg_keeper; we just log it and carry
+ * on without publishing.
+ */
+void
+openStatusFile(void)
+{
+	char		path[MAXPGPATH];
+	int			fd;
+	void	   *addr;
+
+	if (statusFile != NULL)
+		return;
+
+	snprintf(path, MAXPGPATH, "%s/%s", DataDir, PGKEEPER_STATUS_FILENAME);
+
+	if ((fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP)) < 0)
+	{
+		ereport(LOG,
+				(errmsg("could not open status file \"%s\": %m", path)));
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(PgKeeperStatusFile)) != 0)
+	{
+		ereport(LOG,
+				(errmsg("could not resize status file \"%s\": %m", path)));
+		close(fd);
+		return;
+	}
+
+	addr = mmap(NULL, sizeof(PgKeeperStatusFile), PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED)
+	{
+		ereport(LOG,
+				(errmsg("could not map status file \"%s\": %m", path)));
+		return;
+	}
+
+	statusFile = (PgKeeperStatusFile *) addr;
+
+	/*
+	 * Invalidate the contents while we (re)initialize the header so that
+	 * readers never see a half written file with a valid magic.
+	 */
+	statusFile->magic = 0;
+	pg_write_barrier();
+	statusFile->seq = 0;
+	statusFile->version = PGKEEPER_STATUS_VERSION;
+	statusFile->size = sizeof(PgKeeperStatusFile);
+	pg_write_barrier();
+	statusFile->magic = PGKEEPER_STATUS_MAGIC;
+
+	publishStatusFile();
+}
+
+/*
+ * Copy the current state from shared memory into the status file.
+ */
+void
+publishStatusFile(void)
+{
+	KeeperStats	stats;
+	KeeperStatus status;
+	bool		sync_mode;
+	struct timeval tv;
+
+	if (statusFile == NULL)
+		return;
+
+	gettimeofday(&tv, NULL);
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	stats = keeperShmem->stats;
+	status = keeperShmem->current_status;
+	sync_mode = keeperShmem->sync_mode;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	/* Begin update; odd sequence tells readers to retry */
+	statusFile->seq++;
+	pg_write_barrier();
+
+	statusFile->pid = MyProcPid;
+	statusFile->status = (int32) status;
+	statusFile->sync_mode = sync_mode ? 1 : 0;
+	statusFile->retry_count = stats.retry_count;
+	statusFile->updated_at = (int64) tv.tv_sec * USECS_PER_SEC + tv.tv_usec;
+	statusFile->heartbeats = stats.heartbeats;
+	statusFile->heartbeat_failures = stats.heartbeat_failures;
+	statusFile->promotions = stats.promotions;
+	statusFile->async_changes = stats.async_changes;
+	statusFile->latency_last = stats.latency_last;
+	statusFile->latency_min = stats.latency_min;
+	statusFile->latency_max = stats.latency_max;
+	statusFile->latency_sum = stats.latency_sum;
+	statusFile->latency_count = stats.latency_count;
+	statusFile->partner_lsn = stats.partner_lsn;
+	statusFile->received_lsn = stats.received_lsn;
+	statusFile->walreceiver_restarts = stats.walreceiver_restarts;
+
+	/* End update */
+	pg_write_barrier();
+	statusFile->seq++;
+}
@@ -0,0 +1,505 @@
+/* -------------------------------------------------------------------------
+ *
+ * switchover.c
+ *
+ * Planned switchover for pg_keeper.
+ *
+ * pg_keeper_switchover() hands the master role over to the standby
+ * without waiting for the standby to detect a failure.  The work is done
+ * by the master's pg_keeper worker, in four timed phases:
+ *
+ *	drain:		fence the master and terminate its client sessions until
+ *				none is left in a write transaction
+ *	catchup:	wait for the standby to replay all the WAL written so far
+ *	promote:	ask the standby's pg_keeper to promote it right away, and
+ *				wait until it accepts writes
+ *	demote:		launch the rejoin of this server as a standby
+ *
+ * Writes are unavailable from the start of drain until the end of
+ * promote.  Once fenced, no transaction that wrote anything can commit,
+ * see pgkeeper_xact_callback().  Anything that is written nevertheless,
+ * such as COMMIT PREPARED, is caught by checking the WAL position again
+ * after the standby caught up, and waiting for it to catch up again.
+ * What is written between that check and the promotion is lost.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "pg_keeper.h"
+
+#include "access/htup_details.h"
+#include "access/xlog_internal.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+
+#if PG_VERSION_NUM >= 100000
+#define SQL_REPLAY_LSN		"SELECT pg_last_wal_replay_lsn()"
+#else
+#define SQL_REPLAY_LSN		"SELECT pg_last_xlog_replay_location()"
+#endif
+#define SQL_IN_RECOVERY		"SELECT pg_is_in_recovery()"
+#define SQL_PROMOTE			"SELECT pg_keeper_promote()"
+/*
+ * Terminate the client sessions and count those still in a write
+ * transaction, which have yet to process the termination.
+ */
+#define SQL_DRAIN \
+	"SELECT count(*) FILTER (WHERE backend_xid IS NOT NULL) " \
+	"FROM (SELECT backend_xid, pg_terminate_backend(pid) " \
+	SQL_CLIENT_BACKENDS ") s"
+
+#if PG_VERSION_NUM >= 110000
+#define KEEPER_WAL_SEG_SIZE	wal_segment_size
+#else
+#define KEEPER_WAL_SEG_SIZE	XLogSegSize
+#endif
+
+bool	runSwitchover(void);
+bool	promoteRequested(void);
+void	finishSwitchover(KeeperSwitchoverState state);
+void	cleanupSwitchover(void);
+pid_t	switchoverRequester(void);
+
+static XLogRecPtr lastRecordEnd(void);
+static bool waitForValue(PGconn *con, const char *sql, const char *value,
+						 uint64 deadline);
+static bool waitForReplay(PGconn *con, XLogRecPtr lsn, uint64 deadline);
+static void finishPhase(int phase, uint64 *start);
+
+PG_FUNCTION_INFO_V1(pg_keeper_switchover);
+PG_FUNCTION_INFO_V1(pg_keeper_promote);
+
+static const char *const phase_names[SWITCHOVER_NPHASES] = {
+	"drain", "catchup", "promote", "demote"
+};
+
+/* GUC variables */
+int		pgkeeper_switchover_timeout;
+
+/* Connections of the switchover in progress, see cleanupSwitchover() */
+static PGconn *self = NULL;
+static PGconn *standby = NULL;
+
+/*
+ * Do the switchover requested by pg_keeper_switchover(), in the master's
+ * pg_keeper worker.  Returns true once the standby has been promoted and
+ * the rejoin of this server has been launched.  If the standby was asked
+ * to promote but didn't in time, returns false with the master still
+ * fenced.
+ */
+bool
+runSwitchover(void)
+{
+	uint64		start = keeperMonotonicUsec();
+	uint64		deadline = start + (uint64) pgkeeper_switchover_timeout * 1000;
+	XLogRecPtr	final_lsn;
+	char		sql[512];
+	bool		was_fenced = keeperShmem->fenced;
+
+	ereport(LOG,
+			(errmsg("pg_keeper starts switchover to the standby server")));
+
+	/* Connect beforehand, so that this doesn't count as downtime */
+	self = connectBefore(pgkeeper_my_conninfo, deadline);
+	standby = connectBefore(pgkeeper_partner_conninfo, deadline);
+	if (self == NULL || standby == NULL)
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper could not connect to the servers for switchover")));
+		cleanupSwitchover();
+		return false;
+	}
+
+	/* drain */
+	start = keeperMonotonicUsec();
+	if (!was_fenced)
+		fenceMaster();
+	snprintf(sql, sizeof(sql), SQL_DRAIN, (int) switchoverRequester());
+	if (!waitForValue(self, sql, "0", deadline))
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper gave up switchover, write transactions did not finish in time")));
+		goto abort;
+	}
+	finishPhase(0, &start);
+
+	/* catchup, until nothing more has been written meanwhile */
+	for (;;)
+	{
+		final_lsn = lastRecordEnd();
+
+		if (!waitForReplay(standby, final_lsn, deadline))
+		{
+			ereport(LOG,
+					(errmsg("pg_keeper gave up switchover, the standby server did not replay up to %X/%X in time",
+							(uint32) (final_lsn >> 32), (uint32) final_lsn)));
+			goto abort;
+		}
+
+		if (lastRecordEnd() == final_lsn)
+			break;
+	}
+	finishPhase(1, &start);
+
+	/* promote */
+	if (!waitForValue(standby, SQL_PROMOTE, "t", deadline))
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper gave up switchover, the standby server refused to promote")));
+		goto abort;
+	}
+
+	/*
+	 * From here on the standby may become a master at any moment, so we
+	 * must stay fenced even if it doesn't make it in time.  Once it does,
+	 * checkStaleMaster() finds us stale like after a failover.
+	 */
+	if (!waitForValue(standby, SQL_IN_RECOVERY, "f", deadline))
+	{
+		ereport(LOG,
+				(errmsg("pg_keeper did not see the standby server promoted in time, keeping the master server fenced")));
+		cleanupSwitchover();
+		return false;
+	}
+	finishPhase(2, &start);
+
+	PQfinish(self);
+	PQfinish(standby);
+	self = standby = NULL;
+
+	/* demote */
+	startRejoin();
+	finishPhase(3, &start);
+
+	finishSwitchover(SWITCHOVER_DONE);
+
+	return true;
+
+abort:
+	PQfinish(self);
+	PQfinish(standby);
+	self = standby = NULL;
+	if (!was_fenced)
+		unfenceMaster();
+	finishSwitchover(SWITCHOVER_FAILED);
+
+	return false;
+}
+
+/*
+ * Return the end of the last WAL record written.  At a page boundary the
+ * insert position points past the page header, which the standby's replay
+ * position never reaches, so go back to the end of the last record.
+ */
+static XLogRecPtr
+lastRecordEnd(void)
+{
+	XLogRecPtr	lsn = GetXLogInsertRecPtr();
+	uint32		offset;
+
+	if (lsn % KEEPER_WAL_SEG_SIZE == SizeOfXLogLongPHD)
+		lsn -= SizeOfXLogLongPHD;
+	else if ((offset = lsn % XLOG_BLCKSZ) == SizeOfXLogShortPHD)
+		lsn -= offset;
+
+	return lsn;
+}
+
+/*
+ * Return the pid of the backend waiting in pg_keeper_switchover(), or 0
+ * if no switchover is going on.
+ */
+pid_t
+switchoverRequester(void)
+{
+	pid_t	pid = 0;
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	if (keeperShmem->switchover_state == SWITCHOVER_REQUESTED)
+		pid = keeperShmem->switchover_requester;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	return pid;
+}
+
+/*
+ * Has a switchover asked us, the standby's pg_keeper, to promote?
+ * The request is consumed.
+ */
+bool
+promoteRequested(void)
+{
+	bool	requested;
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	requested = keeperShmem->promote_requested;
+	keeperShmem->promote_requested = false;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	return requested;
+}
+
+/*
+ * Run sql repeatedly until it returns value, for at most until deadline.
+ * A server that stops answering mid-query doesn't hold us past deadline.
+ */
+static bool
+waitForValue(PGconn *con, const char *sql, const char *value, uint64 deadline)
+{
+	for (;;)
+	{
+		char	*result;
+		bool	done;
+
+		if (!execQueryBefore(con, sql, deadline, &result))
+		{
+			if (keeperMonotonicUsec() >= deadline)
+				ereport(LOG,
+						(errmsg("timed out getting tuple from server")));
+			else
+				ereport(LOG,
+						(errmsg("could not get tuple from server : %s",
+								PQerrorMessage(con))));
+			return false;
+		}
+
+		done = result != NULL && strcmp(result, value) == 0;
+		if (result)
+			pfree(result);
+
+		if (done)
+			return true;
+		if (keeperMonotonicUsec() >= deadline || got_sigterm)
+			return false;
+
+		/* Poll every millisecond, every one of them is downtime */
+		keeperWaitLatch(1);
+		ResetLatch(&MyProc->procLatch);
+	}
+}
+
+/*
+ * Wait until the standby at con has replayed up to lsn.
+ */
+static bool
+waitForReplay(PGconn *con, XLogRecPtr lsn, uint64 deadline)
+{
+	for (;;)
+	{
+		char	*result;
+		uint32	hi;
+		uint32	lo;
+		bool	done;
+
+		if (!execQueryBefore(con, SQL_REPLAY_LSN, deadline, &result))
+		{
+			if (keeperMonotonicUsec() >= deadline)
+				ereport(LOG,
+						(errmsg("timed out getting tuple from server")));
+			else
+				ereport(LOG,
+						(errmsg("could not get tuple from server : %s",
+								PQerrorMessage(con))));
+			return false;
+		}
+
+		done = result != NULL && sscanf(result, "%X/%X", &hi, &lo) == 2 &&
+			(((uint64) hi) << 32 | lo) >= lsn;
+		if (result)
+			pfree(result);
+
+		if (done)
+			return true;
+		if (keeperMonotonicUsec() >= deadline || got_sigterm)
+			return false;
+
+		keeperWaitLatch(1);
+		ResetLatch(&MyProc->procLatch);
+	}
+}
+
+/* Record how long the phase took, and start timing the next one */
+static void
+finishPhase(int phase, uint64 *start)
+{
+	uint64	now = keeperMonotonicUsec();
+
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->switchover_usec[phase] = now - *start;
+	SpinLockRelease(&keeperShmem->mutex);
+
+	ereport(LOG,
+			(errmsg("pg_keeper switchover phase \"%s\" took %.3f ms",
+					phase_names[phase], (now - *start) / 1000.0)));
+
+	*start = now;
+}
+
+/*
+ * Report the outcome of the switchover to pg_keeper_switchover().
+ */
+void
+finishSwitchover(KeeperSwitchoverState state)
+{
+	SpinLockAcquire(&keeperShmem->mutex);
+	keeperShmem->switchover_state = state;
+	SpinLockRelease(&keeperShmem->mutex);
+}
+
+/*
+ * Close the connections of a switchover cut short, e.g. by an error, and
+ * report it failed unless it has been reported already.
+ */
+void
+cleanupSwitchover(void)
+{
+	PQfinish(self);
+	PQfinish(standby);
+	self = standby = NULL;
+
+	if (keeperShmem->switchover_state == SWITCHOVER_REQUESTED)
+		finishSwitchover(SWITCHOVER_FAILED);
+}
+
+/*
+ * Switch the master role over to the standby, called on the master.
+ * Returns the duration of each phase in milliseconds.
+ */
+Datum
+pg_keeper_switchover(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	uint64	   *usec;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+		KeeperSwitchoverState state;
+		Latch	   *latch;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		if (RecoveryInProgress())
+			ereport(ERROR,
+					(errmsg("switchover must be run on the master server")));
+
+		SpinLockAcquire(&keeperShmem->mutex);
+		if (keeperShmem->keeper_pid == 0 ||
+			keeperShmem->switchover_state == SWITCHOVER_REQUESTED)
+		{
+			SpinLockRelease(&keeperShmem->mutex);
+			ereport(ERROR,
+					(errmsg("pg_keeper is not running, or already switching over")));
+		}
+		keeperShmem->switchover_state = SWITCHOVER_REQUESTED;
+		keeperShmem->switchover_requester = MyProcPid;
+		memset(keeperShmem->switchover_usec, 0,
+			   sizeof(keeperShmem->switchover_usec));
+		latch = keeperShmem->keeper_latch;
+		SpinLockRelease(&keeperShmem->mutex);
+
+		SetLatch(latch);
+
+		/* Wait for the worker; our own latch is never set for us */
+		for (;;)
+		{
+			pid_t	pid;
+
+			SpinLockAcquire(&keeperShmem->mutex);
+			state = keeperShmem->switchover_state;
+			pid = keeperShmem->keeper_pid;
+			SpinLockRelease(&keeperShmem->mutex);
+
+			if (state != SWITCHOVER_REQUESTED)
+				break;
+			if (pid == 0)
+				ereport(ERROR,
+						(errmsg("pg_keeper exited during switchover")));
+
+#if PG_VERSION_NUM >= 100000
+			WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					  10L, PG_WAIT_EXTENSION);
+#else
+			WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+					  10L);
+#endif
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		if (state != SWITCHOVER_DONE)
+			ereport(ERROR,
+					(errmsg("switchover failed"),
+					 errhint("See the server log for details.")));
+
+		usec = palloc(sizeof(keeperShmem->switchover_usec));
+		SpinLockAcquire(&keeperShmem->mutex);
+		memcpy(usec, keeperShmem->switchover_usec,
+			   sizeof(keeperShmem->switchover_usec));
+		SpinLockRelease(&keeperShmem->mutex);
+
+		funcctx->user_fctx = usec;
+		funcctx->max_calls = SWITCHOVER_NPHASES;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	usec = (uint64 *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+		HeapTuple	tuple;
+
+		values[0] = CStringGetTextDatum(phase_names[funcctx->call_cntr]);
+		values[1] = Float8GetDatum(usec[funcctx->call_cntr] / 1000.0);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Ask our pg_keeper to promote this standby right away, called by the
+ * master's pg_keeper during a switchover.
+ */
+Datum
+pg_keeper_promote(PG_FUNCTION_ARGS)
+{
+	Latch	   *latch = NULL;
+
+	if (!RecoveryInProgress())
+		PG_RETURN_BOOL(false);
+
+	/* Once we have said yes, the master must not get a lease any more */
+	SpinLockAcquire(&keeperShmem->mutex);
+	if (keeperShmem->keeper_pid != 0)
+	{
+		keeperShmem->promote_requested = true;
+		keeperShmem->lease_revoked = true;
+		latch = keeperShmem->keeper_latch;
+	}
+	SpinLockRelease(&keeperShmem->mutex);
+
+	if (latch == NULL)
+		PG_RETURN_BOOL(false);
+
+	SetLatch(latch);
+
+	PG_RETURN_BOOL(true);
+}
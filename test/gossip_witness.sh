@@ -0,0 +1,193 @@
+#!/bin/sh
+#
+# test/gossip_witness.sh
+#
+# Membership test for the gossip protocol, using three pg_keeper_witness
+# processes on the loopback interface.
+#
+# The first one is the seed of the other two.  Every member must learn of
+# every other one, once with the members started one after the other, and
+# once all at the same moment.  In the latter case the seed starts last,
+# so the others may suspect it until it answers, but must not declare it
+# dead.  Then one member is killed, and the others must suspect it, only
+# then declare it dead, and eventually forget it.  A fourth witness with a
+# different secret must never be let in.  Finally a member is restarted,
+# and the others must not take its messages for replays of its previous
+# run.
+#
+# Usage: test/gossip_witness.sh
+#
+# pg_keeper_witness must be in PATH, or given by WITNESS.
+# Environment: PORT (first of the ports used, default 57001),
+# INTERVAL (gossip interval in ms, default 200), KEEP=1 to keep the logs.
+
+set -e
+
+WITNESS=${WITNESS:-pg_keeper_witness}
+PORT=${PORT:-57001}
+INTERVAL=${INTERVAL:-200}
+
+BASE=$(mktemp -d "${TMPDIR:-/tmp}/pg_keeper_gossip.XXXXXX")
+PIDS=
+
+PGKEEPER_GOSSIP_SECRET=pg_keeper_gossip_test
+export PGKEEPER_GOSSIP_SECRET
+
+cleanup()
+{
+	for pid in $PIDS; do
+		kill "$pid" 2>/dev/null || true
+	done
+	wait 2>/dev/null || true
+	if [ "$KEEP" = 1 ]; then
+		echo "logs kept in $BASE"
+	else
+		rm -rf "$BASE"
+	fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail()
+{
+	echo "FAIL: $*"
+	for log in "$BASE"/*.log; do
+		echo "--- $log"
+		cat "$log"
+	done
+	exit 1
+}
+
+# Start witness number $1 in run $2, with the given extra options
+start_witness()
+{
+	n=$1
+	run=$2
+	shift 2
+	"$WITNESS" -a "127.0.0.1:$((PORT + n))" -i "$INTERVAL" \
+		-f "$BASE/$n.state" "$@" > "$BASE/$run.$n.log" 2>&1 &
+	eval "PID$n=$!"
+	PIDS="$PIDS $!"
+}
+
+# Wait up to $1 seconds until file $2 has $3 lines matching pattern $4
+wait_for_lines()
+{
+	tries=$(($1 * 10))
+	while [ "$(grep -c "$4" "$2" 2>/dev/null || true)" -lt "$3" ]; do
+		tries=$((tries - 1))
+		[ "$tries" -gt 0 ] || return 1
+		sleep 0.1
+	done
+}
+
+SEED=127.0.0.1:$((PORT + 1))
+
+for run in staggered simultaneous; do
+	echo "starting three members, $run"
+
+	PIDS=
+	if [ "$run" = staggered ]; then
+		start_witness 1 $run
+		sleep 1
+		start_witness 2 $run -s "$SEED"
+		sleep 1
+		start_witness 3 $run -s "$SEED"
+	else
+		start_witness 2 $run -s "$SEED"
+		start_witness 3 $run -s "$SEED"
+		start_witness 1 $run
+	fi
+
+	# Seeds are known from the start, the others join
+	wait_for_lines 10 "$BASE/$run.1.log" 2 'joined' ||
+		fail "$run: the seed didn't learn of both members"
+	wait_for_lines 10 "$BASE/$run.2.log" 1 'joined' ||
+		fail "$run: member 2 didn't learn of member 3"
+	wait_for_lines 10 "$BASE/$run.3.log" 1 'joined' ||
+		fail "$run: member 3 didn't learn of member 2"
+
+	# Give a false suspicion time to show up
+	sleep 3
+	if [ "$run" = staggered ] &&
+		grep -q 'is now suspect' "$BASE/$run".*.log; then
+		fail "$run: a live member was suspected"
+	fi
+	if grep -q 'is now dead' "$BASE/$run".*.log; then
+		fail "$run: a live member was declared dead"
+	fi
+
+	for pid in $PIDS; do
+		kill "$pid"
+	done
+	wait
+done
+
+echo "letting in an outsider with another secret"
+PIDS=
+start_witness 1 failure
+start_witness 2 failure -s "$SEED"
+start_witness 3 failure -s "$SEED"
+PGKEEPER_GOSSIP_SECRET=other start_witness 9 failure -s "$SEED"
+
+wait_for_lines 10 "$BASE/failure.1.log" 2 'joined' ||
+	fail "the seed didn't learn of both members"
+sleep 2
+if grep -q "$((PORT + 9))" "$BASE"/failure.[123].log; then
+	fail "a member with another secret was let in"
+fi
+
+echo "killing member 3"
+VICTIM=127.0.0.1:$((PORT + 3))
+kill "$PID3"
+
+for n in 1 2; do
+	log=$BASE/failure.$n.log
+	wait_for_lines 10 "$log" 1 "\"$VICTIM\" is now dead" ||
+		fail "member $n didn't declare member 3 dead"
+
+	# Learning of the suspicion from the other member is fine, but
+	# suspecting it ourselves must come first
+	if ! grep -q "\"$VICTIM\" is now suspect" "$log" &&
+		! grep -q "\"$VICTIM\" is now dead" "$BASE/failure.$((3 - n)).log"; then
+		fail "member $n declared member 3 dead without suspecting it"
+	fi
+	if grep -v "$VICTIM" "$log" | grep -q 'is now suspect\|is now dead'; then
+		fail "member $n suspected a live member"
+	fi
+done
+
+# Suspects have a few periods to refute
+SUSPECT_LINE=$(grep -n "\"$VICTIM\" is now suspect" "$BASE/failure.1.log" | head -1 | cut -d: -f1)
+DEAD_LINE=$(grep -n "\"$VICTIM\" is now dead" "$BASE/failure.1.log" | head -1 | cut -d: -f1)
+if [ -z "$SUSPECT_LINE" ] || [ "$DEAD_LINE" -lt "$SUSPECT_LINE" ]; then
+	fail "the seed didn't suspect member 3 before declaring it dead"
+fi
+
+# Only the seed is remembered for good
+wait_for_lines 60 "$BASE/failure.1.log" 1 "forgetting dead member \"$VICTIM\"" ||
+	fail "the seed didn't forget member 3"
+wait_for_lines 60 "$BASE/failure.2.log" 1 "forgetting dead member \"$VICTIM\"" ||
+	fail "member 2 didn't forget member 3"
+
+echo "restarting member 2"
+RESTARTED=127.0.0.1:$((PORT + 2))
+OLD_INCARNATION=$(cat "$BASE/2.state")
+kill "$PID2"
+wait "$PID2" 2>/dev/null || true
+start_witness 2 restart -s "$SEED"
+
+# Its incarnation must grow, whatever the clock says
+wait_for_lines 10 "$BASE/restart.2.log" 1 'started' ||
+	fail "member 2 didn't restart"
+if [ "$(cat "$BASE/2.state")" -le "$OLD_INCARNATION" ]; then
+	fail "member 2 didn't start a new incarnation"
+fi
+
+# Its messages are numbered from 1 again, which must not be dropped
+sleep 3
+if grep -q "\"$RESTARTED\" is now dead" "$BASE/failure.1.log"; then
+	fail "the seed took the restarted member 2 for dead"
+fi
+
+echo "ok"
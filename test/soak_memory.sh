@@ -0,0 +1,197 @@
+#!/bin/sh
+#
+# test/soak_memory.sh
+#
+# Soak test for the memory footprint of the pg_keeper worker.
+#
+# Sets up a master and a synchronous standby with pg_keeper polling every
+# second and the lease protocol and slot synchronization enabled, lets
+# them run, and samples the VmRSS of both pg_keeper workers from
+# /proc/<pid>/status.  On PostgreSQL 14 or later the memory contexts of
+# the workers are sampled as well, through pg_log_backend_memory_contexts().
+# After a warm-up, any growth beyond a small allowance fails the test.
+#
+# Usage: test/soak_memory.sh [DURATION_SEC]
+#
+# The PostgreSQL bin directory with pg_keeper installed must be in PATH.
+# Environment: WARMUP (sec, default 60), INTERVAL (sec, default 10),
+# RSS_SLACK_KB (default 256), CONTEXT_SLACK (bytes, default 65536),
+# PORT1/PORT2 (default 55432/55433), KEEP=1 to keep the data directories.
+
+set -e
+
+DURATION=${1:-3600}
+WARMUP=${WARMUP:-60}
+INTERVAL=${INTERVAL:-10}
+RSS_SLACK_KB=${RSS_SLACK_KB:-256}
+CONTEXT_SLACK=${CONTEXT_SLACK:-65536}
+PORT1=${PORT1:-55432}
+PORT2=${PORT2:-55433}
+
+BASE=$(mktemp -d "${TMPDIR:-/tmp}/pg_keeper_soak.XXXXXX")
+MASTER=$BASE/master
+STANDBY=$BASE/standby
+CONNINFO1="host=127.0.0.1 port=$PORT1 dbname=postgres user=postgres"
+CONNINFO2="host=127.0.0.1 port=$PORT2 dbname=postgres user=postgres"
+
+MAJOR=$(postgres -V | sed 's/^[^0-9]*\([0-9]*\).*/\1/')
+
+cleanup()
+{
+	pg_ctl stop -D "$STANDBY" -m immediate >/dev/null 2>&1 || true
+	pg_ctl stop -D "$MASTER" -m immediate >/dev/null 2>&1 || true
+	if [ "$KEEP" = 1 ]; then
+		echo "data directories and logs kept in $BASE"
+	else
+		rm -rf "$BASE"
+	fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Returns the pid of the pg_keeper worker of the server in data directory $1
+keeper_pid()
+{
+	pgrep -P "$(head -1 "$1/postmaster.pid")" -f 'pg_keeper' | head -1
+}
+
+# Returns VmRSS of process $1 in kB
+rss_kb()
+{
+	awk '/^VmRSS:/ { print $2 }' "/proc/$1/status"
+}
+
+# Returns the grand total of the memory contexts of process $1, logged by
+# the server in data directory $2 listening on port $3, or 0 before 14
+context_bytes()
+{
+	if [ "$MAJOR" -lt 14 ]; then
+		echo 0
+		return
+	fi
+
+	before=$(grep -c 'Grand total:' "$2/server.log" || true)
+	psql -X -q -h 127.0.0.1 -p "$3" -U postgres -d postgres \
+		 -c "SELECT pg_log_backend_memory_contexts($1)" >/dev/null
+
+	# The worker logs them the next time it checks for interrupts
+	for i in $(seq 1 50); do
+		if [ "$(grep -c 'Grand total:' "$2/server.log" || true)" -gt "$before" ]; then
+			break
+		fi
+		sleep 0.1
+	done
+
+	grep 'Grand total:' "$2/server.log" | tail -1 |
+		sed 's/.*Grand total: \([0-9]*\) bytes.*/\1/'
+}
+
+echo "setting up servers in $BASE"
+
+initdb -D "$MASTER" -U postgres --auth=trust >"$BASE/initdb.log"
+cat >>"$MASTER/postgresql.conf" <<EOF
+port = $PORT1
+listen_addresses = '127.0.0.1'
+unix_socket_directories = '$BASE'
+shared_preload_libraries = 'pg_keeper'
+wal_level = replica
+max_wal_senders = 4
+max_replication_slots = 4
+hot_standby = on
+wal_log_hints = on
+logging_collector = off
+pg_keeper.keepalives_time = 1
+pg_keeper.keepalives_count = 5
+pg_keeper.sync_slots = on
+EOF
+echo "host replication all 127.0.0.1/32 trust" >>"$MASTER/pg_hba.conf"
+cp "$MASTER/postgresql.conf" "$BASE/postgresql.conf.common"
+cat >>"$MASTER/postgresql.conf" <<EOF
+pg_keeper.partner_conninfo = '$CONNINFO2'
+pg_keeper.my_conninfo = '$CONNINFO1'
+EOF
+
+pg_ctl start -D "$MASTER" -w -l "$MASTER/server.log" >/dev/null
+psql -X -q -h 127.0.0.1 -p "$PORT1" -U postgres -d postgres \
+	 -c "CREATE EXTENSION pg_keeper" \
+	 -c "SELECT pg_create_physical_replication_slot('soak_slot', true)"
+
+pg_basebackup -h 127.0.0.1 -p "$PORT1" -U postgres -D "$STANDBY" -R -X stream
+chmod 700 "$STANDBY"
+cp "$BASE/postgresql.conf.common" "$STANDBY/postgresql.conf"
+cat >>"$STANDBY/postgresql.conf" <<EOF
+port = $PORT2
+pg_keeper.partner_conninfo = '$CONNINFO1'
+pg_keeper.my_conninfo = '$CONNINFO2'
+EOF
+
+pg_ctl start -D "$STANDBY" -w -l "$STANDBY/server.log" >/dev/null
+
+# Only now that there is a standby to wait for and grant leases
+psql -X -q -h 127.0.0.1 -p "$PORT1" -U postgres -d postgres \
+	 -c "ALTER SYSTEM SET synchronous_standby_names = '*'" \
+	 -c "ALTER SYSTEM SET pg_keeper.lease_time = 2000" \
+	 -c "SELECT pg_reload_conf()" >/dev/null
+
+echo "warming up for $WARMUP seconds"
+sleep "$WARMUP"
+
+MASTER_PID=$(keeper_pid "$MASTER")
+STANDBY_PID=$(keeper_pid "$STANDBY")
+if [ -z "$MASTER_PID" ] || [ -z "$STANDBY_PID" ]; then
+	echo "pg_keeper is not running, see $BASE/*/server.log" >&2
+	KEEP=1
+	exit 1
+fi
+
+MASTER_RSS0=$(rss_kb "$MASTER_PID")
+STANDBY_RSS0=$(rss_kb "$STANDBY_PID")
+MASTER_CTX0=$(context_bytes "$MASTER_PID" "$MASTER" "$PORT1")
+STANDBY_CTX0=$(context_bytes "$STANDBY_PID" "$STANDBY" "$PORT2")
+
+echo "elapsed  master_rss_kb  master_ctx_bytes  standby_rss_kb  standby_ctx_bytes"
+printf "%7d  %13d  %16d  %14d  %17d\n" 0 \
+	   "$MASTER_RSS0" "$MASTER_CTX0" "$STANDBY_RSS0" "$STANDBY_CTX0"
+
+elapsed=0
+while [ "$elapsed" -lt "$DURATION" ]; do
+	sleep "$INTERVAL"
+	elapsed=$((elapsed + INTERVAL))
+
+	# A restarted worker would hide a leak
+	if [ "$(keeper_pid "$MASTER")" != "$MASTER_PID" ] ||
+	   [ "$(keeper_pid "$STANDBY")" != "$STANDBY_PID" ]; then
+		echo "pg_keeper worker exited during the soak test" >&2
+		KEEP=1
+		exit 1
+	fi
+
+	MASTER_RSS=$(rss_kb "$MASTER_PID")
+	STANDBY_RSS=$(rss_kb "$STANDBY_PID")
+	MASTER_CTX=$(context_bytes "$MASTER_PID" "$MASTER" "$PORT1")
+	STANDBY_CTX=$(context_bytes "$STANDBY_PID" "$STANDBY" "$PORT2")
+
+	printf "%7d  %13d  %16d  %14d  %17d\n" "$elapsed" \
+		   "$MASTER_RSS" "$MASTER_CTX" "$STANDBY_RSS" "$STANDBY_CTX"
+done
+
+status=0
+check()
+{
+	if [ "$3" -gt $(($2 + $4)) ]; then
+		echo "FAIL: $1 grew from $2 to $3" >&2
+		status=1
+	fi
+}
+check "master pg_keeper VmRSS (kB)" "$MASTER_RSS0" "$MASTER_RSS" "$RSS_SLACK_KB"
+check "standby pg_keeper VmRSS (kB)" "$STANDBY_RSS0" "$STANDBY_RSS" "$RSS_SLACK_KB"
+check "master pg_keeper memory contexts (bytes)" "$MASTER_CTX0" "$MASTER_CTX" "$CONTEXT_SLACK"
+check "standby pg_keeper memory contexts (bytes)" "$STANDBY_CTX0" "$STANDBY_CTX" "$CONTEXT_SLACK"
+
+if [ "$status" = 0 ]; then
+	echo "PASS: pg_keeper memory stayed flat for $DURATION seconds"
+else
+	KEEP=1
+fi
+
+exit $status